@@ -21,11 +21,15 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <istream>
+#include <sstream>
 #include <vector>
 
+#include "evaluate.h"
 #include "misc.h"
 #include "position.h"
 #include "search.h"
@@ -70,9 +74,26 @@ benchmark(const Position& current, istream& is)
   string limit      = (is >> token) ? token : "13";
   string sfen_file  = (is >> token) ? token : "default";
   string limitType  = (is >> token) ? token : "depth";
+  // 最後にttstatsを付けると置換表の統計も表示する
+  // ttgeometryを付けると置換表のクラスタの形ごとに同じ局面を探索して比べる
+  // smpscalingを付けるとSmpHelperごとに1からthreadsまで倍々にスレッドを増やして比べる
+  // (depthを指定すれば、その深さまでの時間になる)
+  bool tt_stats    = false;
+  bool tt_geometry = false;
+  bool smp_scaling = false;
+  while (is >> token)
+  {
+    if (token == "ttstats")
+      tt_stats = true;
+    else if (token == "ttgeometry")
+      tt_geometry = true;
+    else if (token == "smpscaling")
+      smp_scaling = true;
+  }
 
   Options["Hash"]    = tt_size;
   Options["Threads"] = threads;
+  TT.set_verbose(tt_stats);
   TT.clear();
 
   if (limitType == "time")
@@ -99,6 +120,7 @@ benchmark(const Position& current, istream& is)
       if (!file.is_open())
       {
         cerr << "Unable to open file " << sfen_file << endl;
+        TT.set_verbose(false);
         return;
       }
 
@@ -111,25 +133,108 @@ benchmark(const Position& current, istream& is)
       file.close();
   }
 
-  uint64_t nodes = 0;
-  TimePoint elapsed = now();
-
-  for (size_t i = 0; i < sfens.size(); ++i)
+  struct BenchRun
+  {
+    string geometry;
+    string helper;
+    int    threads;
+  };
+
+  const string original_geometry = Options["TTGeometry"];
+  const string original_helper   = Options["SmpHelper"];
+  const int    max_threads       = std::max(atoi(threads.c_str()), 1);
+  vector<BenchRun> runs;
+  if (tt_geometry)
+  {
+    for (const char *geometry : { "3x10", "5x12", "4x16" })
+      runs.push_back(BenchRun{ geometry, original_helper, max_threads });
+  }
+  else if (smp_scaling)
+  {
+    for (const char *helper : { "HalfDensity", "DepthOffset", "ABDADA" })
+    {
+      for (int n = 1; n < max_threads; n *= 2)
+        runs.push_back(BenchRun{ original_geometry, helper, n });
+      runs.push_back(BenchRun{ original_geometry, helper, max_threads });
+    }
+  }
+  else
   {
-    Position pos(sfens[i], Threads.main());
-
-    cerr << "\nPosition: " << i + 1 << '/' << sfens.size() << endl;
-    Search::StateStackPtr st;
-    limits.start_time = now();
-    Threads.start_thinking(pos, limits, st);
-    Threads.main()->wait_for_search_finished();
-    nodes += Threads.nodes_searched();
+    runs.push_back(BenchRun{ original_geometry, original_helper, max_threads });
   }
 
-  elapsed = now() - elapsed + 1;
+  stringstream summary;
+  TimePoint    single_thread_time = 0;
 
-  cerr << "\n==========================="
-       << "\nTotal time (ms) : " << elapsed
-       << "\nNodes searched  : " << nodes
-       << "\nNodes/second    : " << 1000 * nodes / elapsed << endl;
+  for (const BenchRun &run : runs)
+  {
+    // 前の条件で覚えた履歴を持ち越さないように、探索の状態も空にする
+    if (runs.size() > 1)
+    {
+      Options["TTGeometry"] = run.geometry;
+      Options["SmpHelper"]  = run.helper;
+      Options["Threads"]    = std::to_string(run.threads);
+      Search::clear();
+    }
+
+    uint64_t nodes = 0;
+    uint64_t eval_hash_probes = 0;
+    uint64_t eval_hash_hits = 0;
+    TTStats tt_counts;
+    tt_counts.clear();
+    TimePoint elapsed = now();
+
+    for (size_t i = 0; i < sfens.size(); ++i)
+    {
+      Position pos(sfens[i], Threads.main());
+
+      cerr << "\nPosition: " << i + 1 << '/' << sfens.size() << endl;
+      Search::StateStackPtr st;
+      limits.start_time = now();
+      Threads.start_thinking(pos, limits, st);
+      Threads.main()->wait_for_search_finished();
+      nodes += Threads.nodes_searched();
+      eval_hash_probes += Threads.eval_hash_probes();
+      eval_hash_hits += Threads.eval_hash_hits();
+      tt_counts += Threads.tt_stats();
+    }
+
+    elapsed = now() - elapsed + 1;
+
+    cerr << "\n==========================="
+         << "\nTotal time (ms) : " << elapsed
+         << "\nNodes searched  : " << nodes
+         << "\nNodes/second    : " << 1000 * nodes / elapsed
+         << "\nEval kernel     : " << Eval::kernel_name()
+         << "\nEval hash       : " << eval_hash_hits << " hits / "
+         << eval_hash_probes - eval_hash_hits << " misses" << endl;
+
+    if (tt_stats)
+      cerr << TT.stats(tt_counts) << endl;
+
+    if (run.threads == 1)
+      single_thread_time = elapsed;
+
+    summary << "\n" << setw(8) << TranspositionTable::geometry_name(TT.geometry())
+            << setw(12) << run.helper
+            << setw(8) << run.threads
+            << setw(10) << elapsed
+            << setw(12) << nodes
+            << setw(10) << 1000 * nodes / elapsed
+            << setw(9) << fixed << setprecision(1)
+            << (tt_counts.probes ? 100.0 * tt_counts.hits / tt_counts.probes : 0.0) << "%"
+            << setw(9) << setprecision(2)
+            << (single_thread_time ? static_cast<double>(single_thread_time) / elapsed : 0.0);
+  }
+
+  if (runs.size() > 1)
+  {
+    Options["TTGeometry"] = original_geometry;
+    Options["SmpHelper"]  = original_helper;
+    Options["Threads"]    = threads;
+    cerr << "\n==========================="
+         << "\ngeometry      helper threads  time(ms)       nodes       nps  tt hits  speedup"
+         << summary.str() << endl;
+  }
+  TT.set_verbose(false);
 }
@@ -17,38 +17,278 @@
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <iomanip>
 #include <sstream>
+#include <thread>
+#include <vector>
 #include <fstream>
+#include <cstdio>
 #include <cstring>
+#include <iostream>
 
 #include "evaluate.h"
 #include "position.h"
 #include "search.h"
 #include "misc.h"
+#include "thread.h"
+#include "usi.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#include <immintrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
 
 namespace Eval
 {
+EvalHash EH;
+
 #ifdef Apery
 #define KKP_BIN "KKP_synthesized.bin"
 #define KPP_BIN "KPP_synthesized.bin"
 #define KK_BIN "KK_synthesized.bin"
-int16_t KPP[kBoardSquare][kFEEnd][kFEEnd];
-int32_t KKP[kBoardSquare][kBoardSquare][kFEEnd];
-int32_t KK[kBoardSquare][kBoardSquare];
+int16_t (*KPP)[kKppTriangle];
+int32_t (*KKP)[kBoardSquare][kFEEnd];
+int32_t (*KK)[kBoardSquare];
 #else
-int16_t KPP[kBoardSquare][kFEEnd][kFEEnd];
-int16_t KKP[kBoardSquare][kBoardSquare][kFEEnd];
+int16_t (*KPP)[kKppTriangle];
+int16_t (*KKP)[kBoardSquare][kFEEnd];
 #endif
 
-Value
-calc_full(const Position &pos, SearchStack *ss)
+// KPPの和を求めるカーネル
+// 起動時にCPUの対応命令を見てselect_kernel()で切り替える
+//
+// sum_kpp      : 1行分の和 row[list[0]] + ... + row[list[n - 1]]
+//                三角形の1行を引くので、listの値はすべて行の番号より小さいこと
+// sum_kpp_line : 三角形に詰めた表から、駒aとlistの各駒の組の和を求める
+//                a以上の駒は別の行の列aを引くことになる
+typedef int (*SumKppFunc)(const int16_t *row, const int *list, int n);
+typedef int (*SumKppLineFunc)(const int16_t *table, int a, const int *list, int n);
+
+int
+sum_kpp_scalar(const int16_t *row, const int *list, int n)
+{
+  int sum = 0;
+  for (int i = 0; i < n; ++i)
+    sum += row[list[i]];
+  return sum;
+}
+
+int
+sum_kpp_line_scalar(const int16_t *table, int a, const int *list, int n)
 {
-  int *list_black = pos.black_kpp_list();
-  int *list_white = pos.white_kpp_list();
+  int sum = 0;
+  for (int i = 0; i < n; ++i)
+    sum += table[kpp_index(a, list[i])];
+  return sum;
+}
 
-  int score = 0;
+// AVX2のgatherで8要素ずつ引く
+// int16_tの表を2byte刻みの32bit単位でgatherし、下位16bitを符号拡張して足し合わせる
+// 上位16bitには隣の要素が入るので捨てる。そのため末尾要素を引くと表の2byte先まで読むが、
+// KPP[80]の(kFEEnd - 1, kFEEnd - 1)は玉と同じ升に駒がいる組なので引かれることはない
+TARGET_AVX2 inline __m256i
+gather_kpp_avx2(__m256i sum, const int16_t *table, __m256i index)
+{
+  __m256i value = _mm256_i32gather_epi32(reinterpret_cast<const int *>(table), index, 2);
+  return _mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_slli_epi32(value, 16), 16));
+}
+
+TARGET_AVX2 inline __m256i
+mask_gather_kpp_avx2(__m256i sum, const int16_t *table, __m256i index, __m256i mask)
+{
+  __m256i value = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int *>(table), index, mask, 2);
+  return _mm256_add_epi32(sum, _mm256_srai_epi32(_mm256_slli_epi32(value, 16), 16));
+}
+
+// 端数はマスク付きで読む(リストの範囲外は読まない)
+TARGET_AVX2 inline __m256i
+tail_mask_avx2(int rest)
+{
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(rest), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+TARGET_AVX2 inline int
+horizontal_sum_avx2(__m256i sum)
+{
+  __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  sum128 = _mm_hadd_epi32(sum128, sum128);
+  sum128 = _mm_hadd_epi32(sum128, sum128);
+  return _mm_cvtsi128_si32(sum128);
+}
+
+// 三角形の添字 max * (max + 1) / 2 + min
+TARGET_AVX2 inline __m256i
+kpp_index_avx2(__m256i a, __m256i b)
+{
+  __m256i hi = _mm256_max_epi32(a, b);
+  __m256i lo = _mm256_min_epi32(a, b);
+  __m256i base = _mm256_srli_epi32(_mm256_mullo_epi32(hi, _mm256_add_epi32(hi, _mm256_set1_epi32(1))), 1);
+  return _mm256_add_epi32(base, lo);
+}
+
+TARGET_AVX2 int
+sum_kpp_avx2(const int16_t *row, const int *list, int n)
+{
+  __m256i sum = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(list + i));
+    sum = gather_kpp_avx2(sum, row, index);
+  }
+  if (i < n)
+  {
+    __m256i mask  = tail_mask_avx2(n - i);
+    __m256i index = _mm256_maskload_epi32(list + i, mask);
+    sum = mask_gather_kpp_avx2(sum, row, index, mask);
+  }
+  return horizontal_sum_avx2(sum);
+}
+
+TARGET_AVX2 int
+sum_kpp_line_avx2(const int16_t *table, int a, const int *list, int n)
+{
+  const __m256i va = _mm256_set1_epi32(a);
+  __m256i sum = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i piece = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(list + i));
+    sum = gather_kpp_avx2(sum, table, kpp_index_avx2(va, piece));
+  }
+  if (i < n)
+  {
+    __m256i mask  = tail_mask_avx2(n - i);
+    __m256i piece = _mm256_maskload_epi32(list + i, mask);
+    sum = mask_gather_kpp_avx2(sum, table, kpp_index_avx2(va, piece), mask);
+  }
+  return horizontal_sum_avx2(sum);
+}
+
+SumKppFunc     sum_kpp      = sum_kpp_scalar;
+SumKppLineFunc sum_kpp_line = sum_kpp_line_scalar;
+const char *kernel = "scalar";
+
+// SSE4.1にはgatherがないので、AVX2が使えなければスカラー版を使う
+void
+select_kernel()
+{
+#if defined(_MSC_VER)
+  // OSがYMMレジスタを保存していることも確認する
+  int info[4];
+  __cpuid(info, 1);
+  bool avx2 = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+  if (avx2)
+  {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+  sum_kpp      = avx2 ? sum_kpp_avx2 : sum_kpp_scalar;
+  sum_kpp_line = avx2 ? sum_kpp_line_avx2 : sum_kpp_line_scalar;
+  kernel  = avx2 ? "avx2" : "scalar";
+}
+
+const char *
+kernel_name()
+{
+  return kernel;
+}
+
+// リストのすべての組についてのKPPの和
+// リストを昇順に並べ替えれば、i番目の駒との組はすべて三角形のsorted[i]の行に並ぶ
+inline int
+sum_kpp_triangle(const int16_t *table, const int *list)
+{
+  int sorted[kListNum];
+  std::memcpy(sorted, list, sizeof(sorted));
+  std::sort(sorted, sorted + kListNum);
+
+  int sum = 0;
+  for (int i = 1; i < kListNum; ++i)
+    sum += sum_kpp(table + kpp_index(sorted[i], 0), sorted, i);
+  return sum;
+}
+
+void
+KppCache::clear()
+{
+  for (auto &e : entry_)
+    for (auto &f : e)
+      f.valid = false;
+}
+
+// 玉の升ごとに覚えておいた駒リストとの違いだけを計算して、KPPの和を求める
+// 1駒変わるごとにKPPを2駒分引くので、変わった駒が多ければ全計算し直す
+int
+sum_kpp_cached(KppCacheEntry *e, const int16_t *table, const int *list)
+{
+  constexpr int kMaxUpdate = (kListNum - 1) / 4;
+
+  int changed[kListNum];
+  int n = 0;
+
+  if (e->valid)
+  {
+    for (int i = 0; i < kListNum && n <= kMaxUpdate; ++i)
+    {
+      if (e->list[i] != list[i])
+        changed[n++] = i;
+    }
+  }
+
+  if (!e->valid || n > kMaxUpdate)
+  {
+    std::memcpy(e->list, list, sizeof(e->list));
+    e->kpp   = sum_kpp_triangle(table, list);
+    e->valid = true;
+    return e->kpp;
+  }
+
+  // KPPは対称で対角成分が0なので、1駒ずつ入れ替えればよい
+  int kpp = e->kpp;
+  for (int k = 0; k < n; ++k)
+  {
+    const int i = changed[k];
+    kpp -= sum_kpp_line(table, e->list[i], e->list, kListNum);
+    e->list[i] = list[i];
+    kpp += sum_kpp_line(table, e->list[i], e->list, kListNum);
+  }
+  e->kpp = kpp;
+  return kpp;
+}
+
+// 玉の升を視点とするKPPの和(後手側は符号を反転する前の値)
+// スレッドがあればそのキャッシュを使う
+int
+sum_kpp_king(const Position &pos, Color c, Square sq_king, const int *list)
+{
+  Thread *th = pos.this_thread();
+  if (th == nullptr)
+    return sum_kpp_triangle(KPP[sq_king], list);
+  return sum_kpp_cached(&th->kpp_cache_.entry_[c][sq_king], KPP[sq_king], list);
+}
+
+// 全計算
+// stの駒リストとposの玉の位置からKPP/KKPを計算してstに格納する
+// use_cacheがfalseなら玉の升ごとのキャッシュを使わずに計算する
+void
+calc_full(const Position &pos, StateInfo *st, bool use_cache = true)
+{
+  const int *list_black = st->black_kpp_list;
+  const int *list_white = st->white_kpp_list;
 
 #ifdef Apery
   Square sq_black_king     = conv_sq(pos.square_king(kBlack));
@@ -60,38 +300,34 @@ calc_full(const Position &pos, SearchStack *ss)
   Square inv_sq_white_king = inverse(pos.square_king(kWhite));
 #endif
 
-  int black_kpp = 0;
-  int white_kpp = 0;
-  int kkp = KKP[sq_black_king][sq_white_king][list_black[0]];
+  int black_kpp;
+  int white_kpp;
+  if (use_cache)
+  {
+    black_kpp = sum_kpp_king(pos, kBlack, sq_black_king, list_black);
+    white_kpp = -sum_kpp_king(pos, kWhite, inv_sq_white_king, list_white);
+  }
+  else
+  {
+    black_kpp = sum_kpp_triangle(KPP[sq_black_king], list_black);
+    white_kpp = -sum_kpp_triangle(KPP[inv_sq_white_king], list_white);
+  }
+  int kkp = 0;
 #ifdef Apery
   kkp += KK[sq_black_king][sq_white_king];
 #endif
+  const auto *kkp_table = KKP[sq_black_king][sq_white_king];
+  for (int i = 0; i < kListNum; ++i)
+    kkp += kkp_table[list_black[i]];
 
-  for (int i = 1; i < kListNum; ++i)
-  {
-    int k0 = list_black[i];
-    int k1 = list_white[i];
-    for (int j = 0; j < i; ++j)
-    {
-      int l0 = list_black[j];
-      int l1 = list_white[j];
-      black_kpp += KPP[sq_black_king][k0][l0];
-      white_kpp -= KPP[inv_sq_white_king][k1][l1];
-    }
-    kkp += KKP[sq_black_king][sq_white_king][k0];
-  }
-
-  ss->black_kpp = static_cast<Value>(black_kpp);
-  ss->white_kpp = static_cast<Value>(white_kpp);
-  ss->kkp = static_cast<Value>(kkp);
-  ss->material = static_cast<Value>(pos.material() * kFvScale);
-  score = ss->black_kpp + ss->white_kpp + ss->kkp + ss->material;
-
-  return static_cast<Value>(score);
+  st->black_kpp = static_cast<Value>(black_kpp);
+  st->white_kpp = static_cast<Value>(white_kpp);
+  st->kkp       = static_cast<Value>(kkp);
+  st->evaluated = true;
 }
 
 void
-calc_no_capture_difference(const Position &pos, SearchStack *ss)
+calc_no_capture_difference(const Position &pos, const StateInfo *prev, StateInfo *st)
 {
 #ifdef Apery
   Square    black_king        = conv_sq(pos.square_king(kBlack));
@@ -103,44 +339,40 @@ calc_no_capture_difference(const Position &pos, SearchStack *ss)
   Square    inv_white_king    = inverse(white_king);
 #endif
 
-  const int *prev_list_black   = pos.prev_black_kpp_list();
-  const int *prev_list_white   = pos.prev_white_kpp_list();
-  const int *list_black        = pos.black_kpp_list();
-  const int *list_white        = pos.white_kpp_list();
+  const int *prev_list_black   = prev->black_kpp_list;
+  const int *prev_list_white   = prev->white_kpp_list;
+  const int *list_black        = st->black_kpp_list;
+  const int *list_white        = st->white_kpp_list;
+  const int  list_index_move   = st->list_index_move;
 
-  assert(pos.list_index_move() < 38);
+  assert(list_index_move < 38);
 
   int black_kpp_diff = 0;
   int white_kpp_diff = 0;
-  const auto *black_prev_kpp_table = KPP[black_king][prev_list_black[pos.list_index_move()]];
-  const auto *black_kpp_table      = KPP[black_king][list_black[pos.list_index_move()]];
-  const auto *white_prev_kpp_table = KPP[inv_white_king][prev_list_white[pos.list_index_move()]];
-  const auto *white_kpp_table      = KPP[inv_white_king][list_white[pos.list_index_move()]];
-  for (int i = 0; i < kListNum; ++i)
-  {
-    // 前回のを引く
-    black_kpp_diff -= black_prev_kpp_table[prev_list_black[i]];
-    // 今回のを足す
-    black_kpp_diff += black_kpp_table[list_black[i]];
+  const int16_t *black_kpp_table = KPP[black_king];
+  const int16_t *white_kpp_table = KPP[inv_white_king];
+  // 前回のを引く
+  black_kpp_diff -= sum_kpp_line(black_kpp_table, prev_list_black[list_index_move], prev_list_black, kListNum);
+  // 今回のを足す
+  black_kpp_diff += sum_kpp_line(black_kpp_table, list_black[list_index_move], list_black, kListNum);
 
-    // 前回のを引く
-    white_kpp_diff += white_prev_kpp_table[prev_list_white[i]];
-    // 今回のを足す
-    white_kpp_diff -= white_kpp_table[list_white[i]];
-  }
   // 前回のを引く
-  int kkp_diff = -KKP[black_king][white_king][prev_list_black[pos.list_index_move()]];
+  white_kpp_diff += sum_kpp_line(white_kpp_table, prev_list_white[list_index_move], prev_list_white, kListNum);
   // 今回のを足す
-  kkp_diff += KKP[black_king][white_king][list_black[pos.list_index_move()]];
+  white_kpp_diff -= sum_kpp_line(white_kpp_table, list_white[list_index_move], list_white, kListNum);
 
-  ss->black_kpp = (ss - 1)->black_kpp + black_kpp_diff;
-  ss->white_kpp = (ss - 1)->white_kpp + white_kpp_diff;
-  ss->kkp       = (ss - 1)->kkp + kkp_diff;
-  ss->material  = static_cast<Value>(pos.material() * kFvScale);
+  // 前回のを引く
+  int kkp_diff = -KKP[black_king][white_king][prev_list_black[list_index_move]];
+  // 今回のを足す
+  kkp_diff += KKP[black_king][white_king][list_black[list_index_move]];
+
+  st->black_kpp = prev->black_kpp + black_kpp_diff;
+  st->white_kpp = prev->white_kpp + white_kpp_diff;
+  st->kkp       = prev->kkp + kkp_diff;
 }
 
 void
-calc_difference_capture(const Position &pos, SearchStack *ss)
+calc_difference_capture(const Position &pos, const StateInfo *prev, StateInfo *st)
 {
 #ifdef Apery
   Square    black_king        = conv_sq(pos.square_king(kBlack));
@@ -152,71 +384,77 @@ calc_difference_capture(const Position &pos, SearchStack *ss)
   Square    inv_white_king    = inverse(white_king);
 #endif
 
-  const int *prev_list_black   = pos.prev_black_kpp_list();
-  const int *prev_list_white   = pos.prev_white_kpp_list();
-  const int *list_black        = pos.black_kpp_list();
-  const int *list_white        = pos.white_kpp_list();
+  const int *prev_list_black    = prev->black_kpp_list;
+  const int *prev_list_white    = prev->white_kpp_list;
+  const int *list_black         = st->black_kpp_list;
+  const int *list_white         = st->white_kpp_list;
+  const int  list_index_move    = st->list_index_move;
+  const int  list_index_capture = st->list_index_capture;
 
-  assert(pos.list_index_capture() < 38);
-  assert(pos.list_index_move() < 38);
+  assert(list_index_capture < 38);
+  assert(list_index_move < 38);
 
   int black_kpp_diff = 0;
   int white_kpp_diff = 0;
-  const auto *black_prev_kpp_table     = KPP[black_king][prev_list_black[pos.list_index_move()]];
-  const auto *black_prev_cap_kpp_table = KPP[black_king][prev_list_black[pos.list_index_capture()]];
-  const auto *black_kpp_table          = KPP[black_king][list_black[pos.list_index_move()]];
-  const auto *black_cap_kpp_table      = KPP[black_king][list_black[pos.list_index_capture()]];
-  const auto *white_prev_kpp_table     = KPP[inv_white_king][prev_list_white[pos.list_index_move()]];
-  const auto *white_prev_cap_kpp_table = KPP[inv_white_king][prev_list_white[pos.list_index_capture()]];
-  const auto *white_kpp_table          = KPP[inv_white_king][list_white[pos.list_index_move()]];
-  const auto *white_cap_kpp_table      = KPP[inv_white_king][list_white[pos.list_index_capture()]];
+  const int16_t *black_kpp_table = KPP[black_king];
+  const int16_t *white_kpp_table = KPP[inv_white_king];
+  const int prev_black_move    = prev_list_black[list_index_move];
+  const int prev_black_capture = prev_list_black[list_index_capture];
+  const int black_move         = list_black[list_index_move];
+  const int black_capture      = list_black[list_index_capture];
+  const int prev_white_move    = prev_list_white[list_index_move];
+  const int prev_white_capture = prev_list_white[list_index_capture];
+  const int white_move         = list_white[list_index_move];
+  const int white_capture      = list_white[list_index_capture];
 
-  for (int i = 0; i < kListNum; ++i)
-  {
-    // 前回のを引く
-    black_kpp_diff -= black_prev_kpp_table[prev_list_black[i]];
-    // とった分も引く
-    black_kpp_diff -= black_prev_cap_kpp_table[prev_list_black[i]];
-    // 今回のを足す
-    black_kpp_diff += black_kpp_table[list_black[i]];
-    black_kpp_diff += black_cap_kpp_table[list_black[i]];
+  // 前回のを引く
+  black_kpp_diff -= sum_kpp_line(black_kpp_table, prev_black_move, prev_list_black, kListNum);
+  // とった分も引く
+  black_kpp_diff -= sum_kpp_line(black_kpp_table, prev_black_capture, prev_list_black, kListNum);
+  // 今回のを足す
+  black_kpp_diff += sum_kpp_line(black_kpp_table, black_move, list_black, kListNum);
+  black_kpp_diff += sum_kpp_line(black_kpp_table, black_capture, list_black, kListNum);
 
-    // 前回のを引く
-    white_kpp_diff += white_prev_kpp_table[prev_list_white[i]];
-    // とった分も引く
-    white_kpp_diff += white_prev_cap_kpp_table[prev_list_white[i]];
+  // 前回のを引く
+  white_kpp_diff += sum_kpp_line(white_kpp_table, prev_white_move, prev_list_white, kListNum);
+  // とった分も引く
+  white_kpp_diff += sum_kpp_line(white_kpp_table, prev_white_capture, prev_list_white, kListNum);
+
+  // 今回のを足す
+  white_kpp_diff -= sum_kpp_line(white_kpp_table, white_move, list_white, kListNum);
+  white_kpp_diff -= sum_kpp_line(white_kpp_table, white_capture, list_white, kListNum);
 
-    // 今回のを足す
-    white_kpp_diff -= white_kpp_table[list_white[i]];
-    white_kpp_diff -= white_cap_kpp_table[list_white[i]];
-  }
   // 前回ので引きすぎたのを足す
-  black_kpp_diff += black_prev_kpp_table[prev_list_black[pos.list_index_capture()]];
+  black_kpp_diff += black_kpp_table[kpp_index(prev_black_move, prev_black_capture)];
   // 今回ので足しすぎたのを引く
-  black_kpp_diff -= black_kpp_table[list_black[pos.list_index_capture()]];
+  black_kpp_diff -= black_kpp_table[kpp_index(black_move, black_capture)];
 
   // 前回ので引きすぎたのを足す
-  white_kpp_diff -= white_prev_kpp_table[prev_list_white[pos.list_index_capture()]];
+  white_kpp_diff -= white_kpp_table[kpp_index(prev_white_move, prev_white_capture)];
   // 今回ので足しすぎたのを引く
-  white_kpp_diff += white_kpp_table[list_white[pos.list_index_capture()]];
+  white_kpp_diff += white_kpp_table[kpp_index(white_move, white_capture)];
 
-  int kkp_diff = -KKP[black_king][white_king][prev_list_black[pos.list_index_move()]];
-  kkp_diff -= KKP[black_king][white_king][prev_list_black[pos.list_index_capture()]];
-  kkp_diff += KKP[black_king][white_king][list_black[pos.list_index_move()]];
-  kkp_diff += KKP[black_king][white_king][list_black[pos.list_index_capture()]];
+  int kkp_diff = -KKP[black_king][white_king][prev_list_black[list_index_move]];
+  kkp_diff -= KKP[black_king][white_king][prev_list_black[list_index_capture]];
+  kkp_diff += KKP[black_king][white_king][list_black[list_index_move]];
+  kkp_diff += KKP[black_king][white_king][list_black[list_index_capture]];
 
-  ss->black_kpp = (ss - 1)->black_kpp + black_kpp_diff;
-  ss->white_kpp = (ss - 1)->white_kpp + white_kpp_diff;
-  ss->kkp       = (ss - 1)->kkp + kkp_diff;
-  ss->material  = static_cast<Value>(pos.material() * kFvScale);
+  st->black_kpp = prev->black_kpp + black_kpp_diff;
+  st->white_kpp = prev->white_kpp + white_kpp_diff;
+  st->kkp       = prev->kkp + kkp_diff;
 }
 
+// 玉が動いた場合の差分計算
+// 動いた側の玉から見たKPPはすべて変わるので玉の升ごとのキャッシュから求め、
+// 反対側は駒を取っていれば取られた駒の分だけ差分計算する
 template<Color kColor>
 void
-calc_difference_king_move_no_capture(const Position &pos, SearchStack *ss)
+calc_difference_king_move(const Position &pos, const StateInfo *prev, StateInfo *st)
 {
-  const int *list_black = pos.black_kpp_list();
-  const int *list_white = pos.white_kpp_list();
+  const int *prev_list_black = prev->black_kpp_list;
+  const int *prev_list_white = prev->white_kpp_list;
+  const int *list_black      = st->black_kpp_list;
+  const int *list_white      = st->white_kpp_list;
 #ifdef Apery
   const Square sq_black_king = conv_sq(pos.square_king(kBlack));
   const Square sq_white_king = conv_sq(pos.square_king(kWhite));
@@ -227,158 +465,977 @@ calc_difference_king_move_no_capture(const Position &pos, SearchStack *ss)
   Square inv_sq_white_king = inverse(pos.square_king(kWhite));
 #endif
 
-  int black_kpp = 0;
-  int white_kpp = 0;
   const auto *kkp_table = KKP[sq_black_king][sq_white_king];
-  int kkp = kkp_table[list_black[0]];
+  int kkp = 0;
 #ifdef Apery
   kkp += KK[sq_black_king][sq_white_king];
 #endif
+  for (int i = 0; i < kListNum; ++i)
+    kkp += kkp_table[list_black[i]];
+
+  const bool capture = move_is_capture(st->last_move);
+  const int  list_index_capture = st->list_index_capture;
+
   if (kColor == kBlack)
   {
-    const auto *black_kpp_table = KPP[sq_black_king];
-    for (int i = 1; i < kListNum; ++i)
+    int white_kpp = prev->white_kpp;
+    if (capture)
     {
-      const int k0 = list_black[i];
-      const auto *black_pp_table = black_kpp_table[k0];
-      for (int j = 0; j < i; ++j)
-      {
-        const int l0 = list_black[j];
-        black_kpp += black_pp_table[l0];
-      }
-      kkp += kkp_table[k0];
+      assert(list_index_capture < 38);
+      // 前回のを引く
+      white_kpp += sum_kpp_line(KPP[inv_sq_white_king], prev_list_white[list_index_capture], prev_list_white, kListNum);
+      // 今回のを足す
+      white_kpp -= sum_kpp_line(KPP[inv_sq_white_king], list_white[list_index_capture], list_white, kListNum);
     }
-    ss->black_kpp = static_cast<Value>(black_kpp);
-    ss->white_kpp = (ss - 1)->white_kpp;
+    st->black_kpp = static_cast<Value>(sum_kpp_king(pos, kBlack, sq_black_king, list_black));
+    st->white_kpp = static_cast<Value>(white_kpp);
   }
   else
   {
-    const auto *white_kpp_table = KPP[inv_sq_white_king];
-    for (int i = 1; i < kListNum; ++i)
+    int black_kpp = prev->black_kpp;
+    if (capture)
     {
-      const int k1 = list_white[i];
-      const auto *white_pp_table = white_kpp_table[k1];
-      for (int j = 0; j < i; ++j)
-      {
-        const int l1 = list_white[j];
-        white_kpp -= white_pp_table[l1];
-      }
-      kkp += kkp_table[list_black[i]];
+      assert(list_index_capture < 38);
+      // 前回のを引く
+      black_kpp -= sum_kpp_line(KPP[sq_black_king], prev_list_black[list_index_capture], prev_list_black, kListNum);
+      // 今回のを足す
+      black_kpp += sum_kpp_line(KPP[sq_black_king], list_black[list_index_capture], list_black, kListNum);
     }
-    ss->black_kpp = (ss - 1)->black_kpp;
-    ss->white_kpp = static_cast<Value>(white_kpp);
+    st->black_kpp = static_cast<Value>(black_kpp);
+    st->white_kpp = static_cast<Value>(-sum_kpp_king(pos, kWhite, inv_sq_white_king, list_white));
   }
-  ss->kkp = static_cast<Value>(kkp);
-  ss->material = static_cast<Value>(pos.material() * kFvScale);
+  st->kkp = static_cast<Value>(kkp);
 }
 
+// prevの値からstの値を差分計算する
+// usはstの局面に至る手を指した側
 void
-calc_difference(const Position &pos, Move last_move, SearchStack *ss)
+calc_difference(const Position &pos, const StateInfo *prev, StateInfo *st, Color us)
 {
-  const Square    from = move_from(last_move);
-  const PieceType type = move_piece_type(last_move);
+  const Move      last_move = st->last_move;
+  const Square    from      = move_from(last_move);
+  const PieceType type      = move_piece_type(last_move);
 
-  if (type == kKing)
+  if (last_move == kMoveNull)
   {
-    if (pos.side_to_move() == kBlack)
-      calc_difference_king_move_no_capture<kWhite>(pos, ss);
+    st->black_kpp = prev->black_kpp;
+    st->white_kpp = prev->white_kpp;
+    st->kkp       = prev->kkp;
+  }
+  else if (type == kKing)
+  {
+    if (us == kBlack)
+      calc_difference_king_move<kBlack>(pos, prev, st);
     else
-      calc_difference_king_move_no_capture<kBlack>(pos, ss);
+      calc_difference_king_move<kWhite>(pos, prev, st);
   }
   else
   {
     if (from >= kBoardSquare)
     {
-      calc_no_capture_difference(pos, ss);
+      calc_no_capture_difference(pos, prev, st);
     }
     else
     {
       const PieceType capture = move_capture(last_move);
 
       if (capture == kPieceNone)
-        calc_no_capture_difference(pos, ss);
+        calc_no_capture_difference(pos, prev, st);
       else
-        calc_difference_capture(pos, ss);
+        calc_difference_capture(pos, prev, st);
     }
   }
+  st->evaluated = true;
 }
 
+#ifdef EVAL_VERIFY
+// 差分計算やキャッシュから求めた結果を、キャッシュを使わない全計算と比較する
+// EVAL_VERIFYノードに1回だけ検証し、不一致なら局面と直前の指し手を出力して全計算の値で上書きする
+void
+verify_difference(const Position &pos, StateInfo *st)
+{
+  if (pos.nodes_searched() % EVAL_VERIFY != 0)
+    return;
 
-Value
-evaluate(const Position &pos, SearchStack *ss)
+  StateInfo full = *st;
+  calc_full(pos, &full, false);
+
+  if
+  (
+    full.black_kpp != st->black_kpp
+    ||
+    full.white_kpp != st->white_kpp
+    ||
+    full.kkp != st->kkp
+  )
+  {
+    sync_cout << "info string eval verify failed"
+              << " sfen " << pos.sfen()
+              << " move " << USI::format_move(st->last_move)
+              << " diff " << st->black_kpp << " " << st->white_kpp << " " << st->kkp
+              << " full " << full.black_kpp << " " << full.white_kpp << " " << full.kkp
+              << sync_endl;
+
+    st->black_kpp = full.black_kpp;
+    st->white_kpp = full.white_kpp;
+    st->kkp       = full.kkp;
+  }
+}
+#endif
+
+// 評価済みの局面まで遡り、そこから差分計算を積み重ねる
+// 遡った先が見つからない場合や、差分計算のほうが全計算より重くなる場合はfalseを返す
+bool
+calc_difference_chain(const Position &pos, StateInfo *st)
 {
-  Value score;
+  // 全計算はKPPの表をおよそ(kListNum - 1)行分引くのに相当する
+  constexpr int kMaxChainCost = kListNum - 1;
+
+  StateInfo *chain[kMaxChainCost];
+  int length = 0;
+  int cost   = 0;
 
-  Move last_move = (ss - 1)->current_move;
-  if ((ss - 1)->evaluated && !(move_piece_type(last_move) == kKing && move_is_capture(last_move)) && is_ok(last_move))
+  for (StateInfo *s = st; !s->evaluated; s = s->previous)
   {
-    calc_difference(pos, last_move, ss);
-    score = ss->black_kpp + ss->white_kpp + ss->kkp + ss->material;
-    if (score != calc_full(pos, ss))abort();
-    assert(calc_full(pos, ss) == score);
-    ss->evaluated = true;
-    score = pos.side_to_move() == kWhite ? -score : score;
-    score /= kFvScale;
+    const Move m = s->last_move;
 
-    assert(score > -kValueInfinite && score < kValueInfinite);
+    if (s->previous == nullptr || m == kMoveNone)
+      return false;
+
+    // 玉が動いた局面の手前は玉の位置が異なるので、玉の移動は最も古い一手でしか扱えない
+    if (move_piece_type(m) == kKing && !s->previous->evaluated)
+      return false;
+
+    // 玉の移動は玉の升ごとのキャッシュから数駒分の差分で求まることが多いので、駒を取る手と同程度とみなす
+    cost +=
+      m == kMoveNull
+      ?
+      1
+      :
+      (
+        move_is_capture(m) || move_piece_type(m) == kKing
+        ?
+        8
+        :
+        4
+      );
+
+    if (cost >= kMaxChainCost)
+      return false;
+
+    chain[length++] = s;
   }
-  else
+
+  // 古いほうから順に適用する
+  // chain[i]の局面に至る手を指したのは、i手前の局面での手番側
+  for (int i = length - 1; i >= 0; --i)
   {
-    score = calc_full(pos, ss);
-    ss->evaluated = true;
+    const Color us = (i & 1) ? pos.side_to_move() : ~pos.side_to_move();
+    calc_difference(pos, chain[i]->previous, chain[i], us);
+  }
+
+  return true;
+}
+
+void
+EvalHash::resize(uint64_t mb_size)
+{
+  constexpr size_t kCacheLineSize = 64;
 
-    score = pos.side_to_move() == kWhite ? -score : score;
+  size_t new_entry_count =
+    mb_size == 0
+    ?
+    0
+    :
+    size_t(1) << msb((mb_size * 1024 * 1024) / sizeof(EvalHashEntry));
 
-    score /= kFvScale;
+  if (new_entry_count == entry_count_)
+    return;
 
-    assert(score > -kValueInfinite && score < kValueInfinite);
+  entry_count_ = new_entry_count;
+
+  free(mem_);
+  mem_   = nullptr;
+  table_ = nullptr;
+
+  // 0MBなら評価値のハッシュを使わない
+  if (entry_count_ == 0)
+    return;
+
+  mem_ = calloc(entry_count_ * sizeof(EvalHashEntry) + kCacheLineSize - 1, 1);
+
+  if (!mem_)
+  {
+    std::cerr << "Failed to allocate " << mb_size
+              << "MB for eval hash." << std::endl;
+    exit(EXIT_FAILURE);
   }
 
+  table_ = (EvalHashEntry *)((uintptr_t(mem_) + kCacheLineSize - 1) & ~(kCacheLineSize - 1));
+}
+
+void
+EvalHash::clear()
+{
+  if (table_)
+    std::memset(table_, 0, entry_count_ * sizeof(EvalHashEntry));
+}
+
+bool
+EvalHash::probe(Key key, StateInfo *st) const
+{
+  if (!table_)
+    return false;
+
+  const EvalHashEntry *e = &table_[static_cast<size_t>(key) & (entry_count_ - 1)];
+  const uint64_t word0 = e->word0_;
+  const uint64_t word1 = e->word1_ ^ word0;
+
+  if ((word1 >> 32) != (key >> 32))
+    return false;
+
+  st->black_kpp = static_cast<Value>(static_cast<int32_t>(word0 >> 32));
+  st->white_kpp = static_cast<Value>(static_cast<int32_t>(word0));
+  st->kkp       = static_cast<Value>(static_cast<int32_t>(word1));
+  st->evaluated = true;
+  return true;
+}
+
+void
+EvalHash::store(Key key, const StateInfo *st)
+{
+  if (!table_)
+    return;
+
+  EvalHashEntry *e = &table_[static_cast<size_t>(key) & (entry_count_ - 1)];
+  const uint64_t word0 =
+    (static_cast<uint64_t>(static_cast<uint32_t>(st->black_kpp)) << 32)
+    |
+    static_cast<uint32_t>(st->white_kpp);
+  const uint64_t word1 = ((key >> 32) << 32) | static_cast<uint32_t>(st->kkp);
+
+  e->word0_ = word0;
+  e->word1_ = word1 ^ word0;
+}
+
+// KPP/KKPの合計に駒割りを足して手番側から見た評価値にする
+Value
+to_value(const Position &pos, int sum)
+{
+  Value score = static_cast<Value>(sum + pos.material() * kFvScale);
+
+  score = pos.side_to_move() == kWhite ? -score : score;
+  score /= kFvScale;
+
+  assert(score > -kValueInfinite && score < kValueInfinite);
+
   return score + kTempo;
 }
+
+Value
+evaluate(const Position &pos)
+{
+  StateInfo *st = pos.state();
+
+  if (!st->evaluated)
+  {
+    const Key key = pos.key();
+    Thread *th = pos.this_thread();
+
+    if (th)
+      ++th->eval_hash_probes_;
+
+    const bool hit = EH.probe(key, st);
+
+    if (!hit && !calc_difference_chain(pos, st))
+      calc_full(pos, st);
+
+#ifdef EVAL_VERIFY
+    verify_difference(pos, st);
+#endif
+
+    if (hit)
+    {
+      if (th)
+        ++th->eval_hash_hits_;
+    }
+    else
+    {
+      EH.store(key, st);
+    }
+  }
+
+  return to_value(pos, st->black_kpp + st->white_kpp + st->kkp);
+}
+
+// 差分計算で引くのは動いた駒の新しい特徴の行とKKPなので、その先頭を読んでおく
+// 玉が動いたとき(calc_difference_king_move)は、動いた側の玉の升のKPPキャッシュと
+// 新しい玉の組のKKPの行を読んでおく
+void
+prefetch_after(const Position &pos, Move m, Key key)
+{
+  if (EvalHashEntry *e = EH.entry(key))
+    prefetch(e);
+
+  const Square    from = move_from(m);
+  const Square    to   = move_to(m);
+  const PieceType type = from >= kBoardSquare
+                         ? to_drop_piece_type(from)
+                         : move_piece_type(m);
+  if (type == kKing)
+  {
+    const Color us = pos.side_to_move();
+#ifdef Apery
+    const Square black_king = conv_sq(us == kBlack ? to : pos.square_king(kBlack));
+    const Square white_king = conv_sq(us == kWhite ? to : pos.square_king(kWhite));
+#else
+    const Square black_king = us == kBlack ? to : pos.square_king(kBlack);
+    const Square white_king = us == kWhite ? to : pos.square_king(kWhite);
+#endif
+    const Square own_king = us == kBlack ? black_king : inverse(white_king);
+
+    if (Thread *th = pos.this_thread())
+      prefetch(&th->kpp_cache_.entry_[us][own_king]);
+    prefetch(KKP[black_king][white_king]);
+    return;
+  }
+
+  const Piece piece = make_piece(move_is_promote(m)
+                                 ? PieceType(type + kFlagPromoted)
+                                 : type,
+                                 pos.side_to_move());
+#ifdef Apery
+  const Square black_king  = conv_sq(pos.square_king(kBlack));
+  const Square white_king  = conv_sq(pos.square_king(kWhite));
+  const int    black_index = PieceToIndexBlackTable[piece] + conv(to);
+  const int    white_index = PieceToIndexWhiteTable[piece] + conv(inverse(to));
+#else
+  const Square black_king  = pos.square_king(kBlack);
+  const Square white_king  = pos.square_king(kWhite);
+  const int    black_index = PieceToIndexBlackTable[piece] + to;
+  const int    white_index = PieceToIndexWhiteTable[piece] + inverse(to);
+#endif
+
+  prefetch(&KPP[black_king][kpp_index(black_index, 0)]);
+  prefetch(&KPP[inverse(white_king)][kpp_index(white_index, 0)]);
+  prefetch(&KKP[black_king][white_king][black_index]);
+}
   
+// f(0)からf(count - 1)をmax_threads個までのスレッドで分けて呼ぶ
+template<class F>
+void
+parallel_for(size_t count, F f, size_t max_threads = 8)
+{
+  const size_t thread_num = std::min<size_t>(std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), max_threads), count);
+  std::atomic<size_t> next(0);
+  auto worker = [&]()
+  {
+    for (size_t i = next++; i < count; i = next++)
+      f(i);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_num; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads)
+    t.join();
+}
+
+// 1スレッドあたりこれだけの局面がなければスレッドを増やさない
+constexpr size_t kBatchPerThread = 256;
+
+// 1局面ずつ全計算するとKPPの行が局面ごとに入れ替わるので、
+// 先手玉の升ごとに先手側のKPPとKKPを、後手玉の升ごとに後手側のKPPをまとめて計算する
+// 升ごとの組を1つのスレッドが受け持つので、行はそのスレッドのキャッシュに乗ったままになる
+void
+evaluate_batch(const Position *const positions[], size_t count, Value values[])
+{
+  std::vector<int> black_sum(count);
+  std::vector<int> white_sum(count);
+  std::vector<std::vector<size_t>> black_group(kBoardSquare);
+  std::vector<std::vector<size_t>> white_group(kBoardSquare);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    const Position &pos = *positions[i];
+#ifdef Apery
+    black_group[conv_sq(pos.square_king(kBlack))].push_back(i);
+    white_group[inverse(conv_sq(pos.square_king(kWhite)))].push_back(i);
+#else
+    black_group[pos.square_king(kBlack)].push_back(i);
+    white_group[inverse(pos.square_king(kWhite))].push_back(i);
+#endif
+  }
+
+  parallel_for
+  (
+    2 * kBoardSquare,
+    [&](size_t g)
+    {
+      const Square sq_king = static_cast<Square>(g % kBoardSquare);
+      const int16_t *table = KPP[sq_king];
+      if (g < kBoardSquare)
+      {
+        for (size_t i : black_group[sq_king])
+        {
+          const Position &pos  = *positions[i];
+          const int      *list = pos.black_kpp_list();
+#ifdef Apery
+          const Square sq_white_king = conv_sq(pos.square_king(kWhite));
+          int sum = KK[sq_king][sq_white_king];
+#else
+          const Square sq_white_king = pos.square_king(kWhite);
+          int sum = 0;
+#endif
+          const auto *kkp_table = KKP[sq_king][sq_white_king];
+          for (int j = 0; j < kListNum; ++j)
+            sum += kkp_table[list[j]];
+          black_sum[i] = sum + sum_kpp_triangle(table, list);
+        }
+      }
+      else
+      {
+        for (size_t i : white_group[sq_king])
+          white_sum[i] = -sum_kpp_triangle(table, positions[i]->white_kpp_list());
+      }
+    },
+    count / kBatchPerThread + 1
+  );
+
+  for (size_t i = 0; i < count; ++i)
+    values[i] = to_value(*positions[i], black_sum[i] + white_sum[i]);
+}
+
+// 重みを読み直したら、覚えておいた値は使えない
+void
+clear_caches()
+{
+  EH.clear();
+  for (Thread *th : Threads)
+    th->kpp_cache_.clear();
+}
+
+// 重みを置いているメモリ
+struct WeightMemory
+{
+  void  *ptr;
+  size_t size;
+};
+
+std::vector<WeightMemory> weight_memory;
+
+// 0で初期化したメモリを確保する
+// 可能なら2MBのラージページを使い、使えなければTHPに任せる
+// *sizeは実際に確保した大きさに更新する
+void *
+allocate_weight(size_t *size)
+{
+#if defined(_MSC_VER)
+  return calloc(*size, 1);
+#else
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+  const size_t huge_size = (*size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  p = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+    *size = huge_size;
+#endif
+  if (p == MAP_FAILED)
+  {
+    p = mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return nullptr;
+#ifdef MADV_HUGEPAGE
+    madvise(p, *size, MADV_HUGEPAGE);
+#endif
+  }
+  return p;
+#endif
+}
+
+void
+release_weight(const WeightMemory &m)
+{
+#if defined(_MSC_VER)
+  free(m.ptr);
+#else
+  munmap(m.ptr, m.size);
+#endif
+}
+
+// 0で埋めた重み用のメモリを確保する
+char *
+allocate_zero_weight(size_t size)
+{
+  size_t allocated = size;
+  void *p = allocate_weight(&allocated);
+  if (!p)
+  {
+    std::cerr << "Failed to allocate " << size / (1024 * 1024)
+              << "MB for evaluation weights." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  weight_memory.push_back(WeightMemory{ p, allocated });
+  return reinterpret_cast<char *>(p);
+}
+
+// 重みファイルを読み込み専用でmmapする
+// 探索では重みを書き換えないので、同じマシンで動いている他のエンジンとページキャッシュを共有できる。
+// 学習では重みを書き換えて同じファイルに書き出すためmmapしない
+char *
+map_weight(const std::string &path, size_t size)
+{
+#if defined(_MSC_VER) || defined(LEARN)
+  (void)path;
+  (void)size;
+  return nullptr;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return nullptr;
+
+#ifdef MADV_HUGEPAGE
+  madvise(p, size, MADV_HUGEPAGE);
+#endif
+  madvise(p, size, MADV_WILLNEED);
+  weight_memory.push_back(WeightMemory{ p, size });
+  return reinterpret_cast<char *>(p);
+#endif
+}
+
+// ファイルの大きさ(開けなければ0)
+size_t
+file_size(const std::string &path)
+{
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  if (!ifs)
+    return 0;
+  ifs.seekg(0, std::ios::end);
+  return static_cast<size_t>(ifs.tellg());
+}
+
+// 重みの読み込みとチェックサムの計算は1MBのチャンクに分けて並列に行う
+constexpr size_t kChunkSize = 1 << 20;
+
+uint64_t
+hash_chunk(const char *data, size_t size, uint64_t index)
+{
+  uint64_t h = 0xcbf29ce484222325ULL ^ (index * 0x9e3779b97f4a7c15ULL);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8)
+  {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for (; i < size; ++i)
+    h = (h ^ static_cast<uint8_t>(data[i])) * 0x100000001b3ULL;
+  return h;
+}
+
+// dataのチェックサムを求める
+// pathを渡した場合は、先にファイルのoffsetからdataへ読み込む
+// チャンクごとのハッシュのXORなので、スレッドの数によらず同じ値になる
 bool
-init() 
+read_and_checksum(const std::string *path, uint64_t offset, char *data, size_t size, uint64_t *sum)
+{
+  const size_t count = (size + kChunkSize - 1) / kChunkSize;
+  std::vector<uint64_t> chunk_hash(count);
+  std::atomic<bool> ok(true);
+
+  parallel_for(count, [&](size_t i)
+  {
+    const size_t begin = i * kChunkSize;
+    const size_t n     = std::min(kChunkSize, size - begin);
+    if (path)
+    {
+      std::ifstream ifs(*path, std::ios::in | std::ios::binary);
+      ifs.seekg(static_cast<std::streamoff>(offset + begin));
+      ifs.read(data + begin, n);
+      if (!ifs)
+        ok = false;
+    }
+    chunk_hash[i] = hash_chunk(data + begin, n, i);
+  });
+
+  *sum = 0;
+  for (uint64_t h : chunk_hash)
+    *sum ^= h;
+  return ok;
+}
+
+// 評価関数ファイルの形式
+// 先頭にヘッダを置き、続けて各表をページ境界に揃えて並べる。
+// ヘッダには配置(nozomi/Apery)、次元、KPPの詰め方、各表の要素のbit数とチェックサムを持つ
+enum EvalLayout : uint32_t
+{
+  kLayoutNozomi = 1,
+  kLayoutApery  = 2
+};
+
+enum KppPacking : uint32_t
+{
+  kPackingSquare   = 0,
+  kPackingTriangle = 1
+};
+
+enum EvalSection
+{
+  kSectionKpp,
+  kSectionKkp,
+  kSectionKk,
+  kSectionMax
+};
+
+struct EvalFileSection
+{
+  uint64_t offset;
+  uint64_t size;
+  uint64_t checksum;
+  uint32_t bits;
+  uint32_t reserved;
+};
+
+struct EvalFileHeader
+{
+  char            magic[8];
+  uint32_t        version;
+  uint32_t        layout;
+  uint32_t        board_square;
+  uint32_t        fe_end;
+  uint32_t        kpp_packing;
+  uint32_t        section_count;
+  EvalFileSection section[kSectionMax];
+};
+
+constexpr char     kEvalFileMagic[8] = { 'N', 'Z', 'M', 'E', 'V', 'A', 'L', '\0' };
+constexpr uint32_t kEvalFileVersion  = 1;
+constexpr size_t   kEvalFileAlign    = 4096;
+
+const char *
+SectionName[kSectionMax] =
+{
+  "KPP",
+  "KKP",
+  "KK"
+};
+
+// このビルドが期待する表の並び
+#ifdef Apery
+constexpr uint32_t kLayout       = kLayoutApery;
+constexpr int      kSectionCount = 3;
+const size_t       SectionSize[kSectionMax] = { sizeof(KPPTable), sizeof(KKPTable), sizeof(KKTable) };
+const uint32_t     SectionBits[kSectionMax] = { 8 * sizeof(KPP[0][0]), 8 * sizeof(KKP[0][0][0]), 8 * sizeof(KK[0][0]) };
+#else
+constexpr uint32_t kLayout       = kLayoutNozomi;
+constexpr int      kSectionCount = 2;
+const size_t       SectionSize[kSectionMax] = { sizeof(KPPTable), sizeof(KKPTable), 0 };
+const uint32_t     SectionBits[kSectionMax] = { 8 * sizeof(KPP[0][0]), 8 * sizeof(KKP[0][0][0]), 0 };
+#endif
+
+const char *
+layout_name(uint32_t layout)
+{
+  return layout == kLayoutNozomi ? "nozomi" : layout == kLayoutApery ? "Apery" : "unknown";
+}
+
+void
+set_tables(char *section[kSectionMax])
 {
+  KPP = reinterpret_cast<decltype(KPP)>(section[kSectionKpp]);
+  KKP = reinterpret_cast<decltype(KKP)>(section[kSectionKkp]);
 #ifdef Apery
-  do {
-    // KK
-    std::ifstream ifsKK(KK_BIN, std::ios::binary);
-    if (ifsKK) ifsKK.read(reinterpret_cast<char*>(KK), sizeof(KK));
-    else goto Error;
+  KK  = reinterpret_cast<decltype(KK)>(section[kSectionKk]);
+#endif
+}
+
+bool
+is_eval_file(const std::string &path)
+{
+  char magic[sizeof(kEvalFileMagic)] = {};
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  ifs.read(magic, sizeof(magic));
+  return ifs && std::memcmp(magic, kEvalFileMagic, sizeof(magic)) == 0;
+}
 
-    // KKP
-    std::ifstream ifsKKP(KKP_BIN, std::ios::binary);
-    if (ifsKKP) ifsKKP.read(reinterpret_cast<char*>(KKP), sizeof(KKP));
-    else goto Error;
+// ヘッダ付きの評価関数ファイルを読み込む
+// ヘッダがこのビルドと合わない場合や、チェックサムが合わない場合は*errorに理由を入れてfalseを返す
+bool
+load_eval_file(const std::string &path, std::string *error)
+{
+  EvalFileHeader header;
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  ifs.read(reinterpret_cast<char *>(&header), sizeof(header));
+  ifs.close();
+
+  const size_t size = file_size(path);
 
-    // KPP
-    std::ifstream ifsKPP(KPP_BIN, std::ios::binary);
-    if (ifsKPP) ifsKPP.read(reinterpret_cast<char*>(KPP), sizeof(KPP));
-    else goto Error;
+  if (!ifs || std::memcmp(header.magic, kEvalFileMagic, sizeof(kEvalFileMagic)) != 0)
+  {
+    *error = "not an evaluation file";
+    return false;
+  }
+  if (header.version != kEvalFileVersion)
+  {
+    *error = "unsupported version " + std::to_string(header.version);
+    return false;
+  }
+  if (header.layout != kLayout)
+  {
+    *error = std::string("layout is ") + layout_name(header.layout) + " but this build expects " + layout_name(kLayout);
+    return false;
+  }
+  if
+  (
+    header.board_square != kBoardSquare
+    ||
+    header.fe_end != kFEEnd
+    ||
+    header.kpp_packing != kPackingTriangle
+    ||
+    header.section_count != kSectionCount
+  )
+  {
+    *error = "dimensions do not match";
+    return false;
+  }
+  for (int i = 0; i < kSectionCount; ++i)
+  {
+    const EvalFileSection &s = header.section[i];
+    if (s.size != SectionSize[i] || s.bits != SectionBits[i] || s.offset % kEvalFileAlign != 0 || s.offset + s.size > size)
+    {
+      *error = std::string("section ") + SectionName[i] + " does not match";
+      return false;
+    }
+  }
 
-  } while (0);
+  // mmapできなければ、各表を並列に読み込む
+  char *base = map_weight(path, size);
+  const bool mapped = base != nullptr;
+  if (!mapped)
+    base = allocate_zero_weight(size);
 
+  char *section[kSectionMax] = {};
+  for (int i = 0; i < kSectionCount; ++i)
+  {
+    const EvalFileSection &s = header.section[i];
+    uint64_t sum;
+    section[i] = base + s.offset;
+    if (!read_and_checksum(mapped ? nullptr : &path, s.offset, section[i], s.size, &sum))
+    {
+      *error = std::string("failed to read section ") + SectionName[i];
+      return false;
+    }
+    if (sum != s.checksum)
+    {
+      *error = std::string("checksum mismatch in section ") + SectionName[i];
+      return false;
+    }
+  }
+
+  set_tables(section);
   return true;
+}
+
+// ヘッダのない旧形式の表を1つ読み込む
+// 大きさがsizeと一致すればそのまま、KPPで正方形の大きさなら三角形に詰めて読み込む
+char *
+load_raw_table(const std::string &path, EvalSection kind, size_t offset, size_t file_total, size_t full_total)
+{
+  const size_t size = SectionSize[kind];
+  const size_t actual = file_size(path);
+  uint64_t sum;
+
+  if (actual == file_total)
+  {
+    char *base = map_weight(path, file_total);
+    if (base)
+      return base + offset;
+
+    char *p = allocate_zero_weight(size);
+    return read_and_checksum(&path, offset, p, size, &sum) ? p : nullptr;
+  }
 
-Error:;
-  std::cout << "\ninfo string open evaluation file failed.\n";
-  //    cout << "\nERROR open evaluation file failed.\n";
-  // 評価関数ファイルの読み込みに失敗した場合、思考を開始しないように抑制したほうがいいと思う。
+  if (kind == kSectionKpp && actual == full_total)
+  {
+    // 旧形式の正方形のKPPから、i >= jの部分だけを三角形に詰める
+    int16_t (*kpp)[kKppTriangle] = reinterpret_cast<int16_t (*)[kKppTriangle]>(allocate_zero_weight(size));
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    std::vector<int16_t> row(kFEEnd);
+    for (int k = 0; k < kBoardSquare; ++k)
+    {
+      for (int i = 0; i < kFEEnd; ++i)
+      {
+        ifs.read(reinterpret_cast<char *>(row.data()), sizeof(int16_t) * kFEEnd);
+        std::memcpy(kpp[k] + kpp_index(i, 0), row.data(), sizeof(int16_t) * (i + 1));
+      }
+    }
+    return ifs ? reinterpret_cast<char *>(kpp) : nullptr;
+  }
+
+  return nullptr;
+}
+
+// ヘッダのない旧形式のファイルを読み込む
+bool
+load_raw_files(std::string *error)
+{
+  char *section[kSectionMax] = {};
+#ifdef Apery
+  const std::string dir = Options["EvalDir"];
+  const std::string path[kSectionMax] = { dir + "/" + KPP_BIN, dir + "/" + KKP_BIN, dir + "/" + KK_BIN };
+  for (int i = 0; i < kSectionCount; ++i)
+  {
+    section[i] = load_raw_table(path[i], EvalSection(i), 0, SectionSize[i], sizeof(KPPFullTable));
+    if (!section[i])
+    {
+      *error = path[i] + " not found or has an unexpected size";
+      return false;
+    }
+  }
 #else
-  std::ifstream ifs("new_fv.bin", std::ios::in | std::ios::binary);
-  if (!ifs)
+  // KPP, KKPの順に並んだ1つのファイル
+  const std::string path = Options["EvalFile"];
+  const size_t packed_size = sizeof(KPPTable) + sizeof(KKPTable);
+  const size_t full_size   = sizeof(KPPFullTable) + sizeof(KKPTable);
+  const size_t actual      = file_size(path);
+  section[kSectionKpp] = load_raw_table(path, kSectionKpp, 0, packed_size, full_size);
+  section[kSectionKkp] =
+    load_raw_table(path, kSectionKkp, actual == full_size ? sizeof(KPPFullTable) : sizeof(KPPTable), actual, 0);
+  if (!section[kSectionKpp] || !section[kSectionKkp])
   {
-    std::memset(KPP, 0, sizeof(KPP));
-    std::memset(KKP, 0, sizeof(KKP));
+    *error = path + " not found or has an unexpected size";
     return false;
   }
-  ifs.read(reinterpret_cast<char *>(KPP), sizeof(KPP));
-  ifs.read(reinterpret_cast<char *>(KKP), sizeof(KKP));
-  ifs.close();
+#endif
 
+  set_tables(section);
+  sync_cout << "info string loaded evaluation weights without a header."
+            << " convert them with convert_eval to enable validation" << sync_endl;
   return true;
+}
+
+bool
+init() 
+{
+  select_kernel();
+
+  for (const WeightMemory &m : weight_memory)
+    release_weight(m);
+  weight_memory.clear();
+
+  const std::string path = Options["EvalFile"];
+  std::string error;
+  bool result;
+
+  if (is_eval_file(path))
+    result = load_eval_file(path, &error);
+  else
+    result = load_raw_files(&error);
+
+  // 読み込めなかった場合は0の重みで動くが、黙って続けないように理由を表示する
+  if (!result)
+  {
+    char *p = allocate_zero_weight(sizeof(KPPTable) + sizeof(KKPTable) + SectionSize[kSectionKk]);
+    char *section[kSectionMax] = { p, p + sizeof(KPPTable), p + sizeof(KPPTable) + sizeof(KKPTable) };
+    set_tables(section);
+    sync_cout << "info string open evaluation file failed: " << error
+              << ". all weights are zero" << sync_endl;
+  }
+
+  clear_caches();
+
+  return result;
+}
+
+bool
+save(const std::string &path, EvalFileFormat format)
+{
+  // 読み込み中のファイルに上書きしてもmmapしている内容が壊れないように、別名で書いてから置き換える
+  const std::string tmp = path + ".tmp";
+  std::ofstream ofs(tmp, std::ios::out | std::ios::binary);
+  if (!ofs)
+    return false;
+
+  const char *section[kSectionMax] =
+  {
+    reinterpret_cast<const char *>(KPP),
+    reinterpret_cast<const char *>(KKP),
+#ifdef Apery
+    reinterpret_cast<const char *>(KK)
+#else
+    nullptr
+#endif
+  };
+
+  if (format == kEvalFileContainer)
+  {
+    EvalFileHeader header = {};
+    std::memcpy(header.magic, kEvalFileMagic, sizeof(kEvalFileMagic));
+    header.version       = kEvalFileVersion;
+    header.layout        = kLayout;
+    header.board_square  = kBoardSquare;
+    header.fe_end        = kFEEnd;
+    header.kpp_packing   = kPackingTriangle;
+    header.section_count = kSectionCount;
+
+    uint64_t offset = kEvalFileAlign;
+    for (int i = 0; i < kSectionCount; ++i)
+    {
+      EvalFileSection &s = header.section[i];
+      s.offset = offset;
+      s.size   = SectionSize[i];
+      s.bits   = SectionBits[i];
+      read_and_checksum(nullptr, 0, const_cast<char *>(section[i]), s.size, &s.checksum);
+      offset = (offset + s.size + kEvalFileAlign - 1) & ~(kEvalFileAlign - 1);
+    }
+
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (int i = 0; i < kSectionCount; ++i)
+    {
+      const EvalFileSection &s = header.section[i];
+      const std::vector<char> padding(s.offset - static_cast<uint64_t>(ofs.tellp()), 0);
+      ofs.write(padding.data(), padding.size());
+      ofs.write(section[i], s.size);
+    }
+  }
+  else
+  {
+    // ヘッダのない旧形式。AperyではKPPの表だけを書き出す
+    if (format == kEvalFileRawPacked)
+    {
+      ofs.write(section[kSectionKpp], sizeof(KPPTable));
+    }
+    else
+    {
+      std::vector<int16_t> row(kFEEnd);
+      for (int k = 0; k < kBoardSquare; ++k)
+      {
+        for (int i = 0; i < kFEEnd; ++i)
+        {
+          for (int j = 0; j < kFEEnd; ++j)
+            row[j] = KPP[k][kpp_index(i, j)];
+          ofs.write(reinterpret_cast<const char *>(row.data()), sizeof(int16_t) * kFEEnd);
+        }
+      }
+    }
+#ifndef Apery
+    ofs.write(section[kSectionKkp], sizeof(KKPTable));
 #endif
+  }
+
+  ofs.close();
+  if (!ofs)
+    return false;
 
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
 }
 } // namespace Eval
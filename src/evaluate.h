@@ -19,11 +19,13 @@
 #ifndef _EVALUATE_H_
 #define _EVALUATE_H_
 
+#include <string>
+
 #include "types.h"
 #include "move.h"
 
 class Position;
-struct SearchStack;
+struct StateInfo;
 
 namespace Eval 
 {
@@ -336,11 +338,114 @@ inverse(Square sq)
   return static_cast<Square>(kBoardSquare - 1 - sq);
 }
 
+// KPPは対称なので、i >= jの組だけを三角形に詰めて持つ
+// 行iには(i, 0), (i, 1), ..., (i, i)が並ぶ
+constexpr int
+kKppTriangle = kFEEnd * (kFEEnd + 1) / 2;
+
+inline int
+kpp_index(int i, int j)
+{
+  return i >= j ? i * (i + 1) / 2 + j : j * (j + 1) / 2 + i;
+}
+
 extern bool
 init();
 
+// 重みファイルの形式
+enum EvalFileFormat
+{
+  kEvalFileContainer, // ヘッダとチェックサム付き
+  kEvalFileRawPacked, // ヘッダなし、KPPは三角形に詰めたもの
+  kEvalFileRawFull    // ヘッダなし、KPPは正方形(以前の形式)
+};
+
+// 読み込んでいる重みを書き出す
+extern bool
+save(const std::string &path, EvalFileFormat format);
+
+// 重みを書き換えたら、評価値ハッシュとKPPキャッシュに残っている古い値を捨てる
+extern void
+clear_caches();
+
 extern Value 
-evaluate(const Position &pos, SearchStack *ss);
+evaluate(const Position &pos);
+
+// 局面をまとめて全計算する(学習や局面の採点用)
+// 探索用のキャッシュや評価値ハッシュは使わず、positionsの局面は変更しない
+extern void
+evaluate_batch(const Position *const positions[], size_t count, Value values[]);
+
+// mを指した後の局面を評価するときに引く表を先読みする
+// keyはpos.key_after(m)
+extern void
+prefetch_after(const Position &pos, Move m, Key key);
+
+// 使用中のKPP計算カーネルの名前
+extern const char *
+kernel_name();
+
+// 玉の升ごとに最後に計算した駒リストとKPPの和を覚えておく表
+// 玉が動いたときは覚えているリストとの違いだけを差分計算する
+// スレッドごとに持つ
+struct KppCacheEntry
+{
+  int  list[kListNum];
+  int  kpp;
+  bool valid;
+};
+
+struct KppCache
+{
+  void
+  clear();
+
+  KppCacheEntry entry_[kNumberOfColor][kBoardSquare];
+};
+
+// 評価値のハッシュ
+// 局面のKPP/KKPの累積値をPosition::key()で引けるようにしておく
+// 全スレッドで共有し、ロックは取らない。1エントリは64bit×2で、
+// 2つ目のワードに1つ目をXORして書き込むことで書き込み途中のエントリを読んでもキーの照合で弾く
+struct EvalHashEntry
+{
+  uint64_t word0_; // black_kpp(上位32bit) | white_kpp(下位32bit)
+  uint64_t word1_; // (キーの上位32bit | kkp) ^ word0_
+};
+
+class EvalHash
+{
+public:
+  ~EvalHash()
+  {
+    free(mem_);
+  }
+
+  void
+  resize(uint64_t mb_size);
+
+  void
+  clear();
+
+  bool
+  probe(Key key, StateInfo *st) const;
+
+  void
+  store(Key key, const StateInfo *st);
+
+  EvalHashEntry *
+  entry(Key key) const
+  {
+    return table_ ? &table_[static_cast<size_t>(key) & (entry_count_ - 1)] : nullptr;
+  }
+
+private:
+  size_t         entry_count_ = 0;
+  EvalHashEntry *table_       = nullptr;
+  void          *mem_         = nullptr;
+};
+
+extern EvalHash EH;
 
 #ifdef Apery
 #ifdef TWIG
@@ -352,12 +457,19 @@ typedef int16_t ValueKpp;
 typedef int32_t ValueKkp;
 typedef int32_t ValueKk;
 #endif
-extern int16_t KPP[kBoardSquare][kFEEnd][kFEEnd];
-extern int32_t KKP[kBoardSquare][kBoardSquare][kFEEnd];
-extern int32_t KK[kBoardSquare][kBoardSquare];
+typedef int16_t KPPFullTable[kBoardSquare][kFEEnd][kFEEnd];
+typedef int16_t KPPTable[kBoardSquare][kKppTriangle];
+typedef int32_t KKPTable[kBoardSquare][kBoardSquare][kFEEnd];
+typedef int32_t KKTable[kBoardSquare][kBoardSquare];
+extern int16_t (*KPP)[kKppTriangle];
+extern int32_t (*KKP)[kBoardSquare][kFEEnd];
+extern int32_t (*KK)[kBoardSquare];
 #else
-extern int16_t KPP[kBoardSquare][kFEEnd][kFEEnd];
-extern int16_t KKP[kBoardSquare][kBoardSquare][kFEEnd];
+typedef int16_t KPPFullTable[kBoardSquare][kFEEnd][kFEEnd];
+typedef int16_t KPPTable[kBoardSquare][kKppTriangle];
+typedef int16_t KKPTable[kBoardSquare][kBoardSquare][kFEEnd];
+extern int16_t (*KPP)[kKppTriangle];
+extern int16_t (*KKP)[kBoardSquare][kFEEnd];
 #endif
 
 } // namespace Eval
@@ -901,16 +901,14 @@ Learner::update_eval()
   ofs.close();
 
   add_part_param<false>();
-  std::ofstream fs("new_fv.bin", std::ios::binary);
-  fs.write(reinterpret_cast<char *>(Eval::KPP), sizeof(Eval::KPP));
-  fs.write(reinterpret_cast<char *>(Eval::KKP), sizeof(Eval::KKP));
-  fs.close();
+  // 次の反復は同じ局面を評価し直すので、古い重みで計算した値を使わないようにする
+  Eval::clear_caches();
+  Eval::save("new_fv.bin", Eval::kEvalFileContainer);
 }
 
 void
 Learner::learn_phase2_body(RawEvaluater &eval_data)
 {
-  SearchStack ss[2];
   Thread *thread = new Thread();
   eval_data.clear();
   for 
@@ -942,13 +940,12 @@ Learner::learn_phase2_body(RawEvaluater &eval_data)
         setup_states->push(StateInfo());
         pos.do_move(move_data.pv_data[pv_index], setup_states->top());
       }
-      ss[0].evaluated = false;
       const Value record_value = 
         (root_color == pos.side_to_move())
         ?
-        Eval::evaluate(pos, ss + 1)
+        Eval::evaluate(pos)
         :
-        -Eval::evaluate(pos, ss + 1);
+        -Eval::evaluate(pos);
       PRINT_PV(std::cout << ", value: " << record_value << std::endl);
       for (int j = pv_index - 1; j >= 0; --j)
         pos.undo_move(move_data.pv_data[j]);
@@ -964,13 +961,12 @@ Learner::learn_phase2_body(RawEvaluater &eval_data)
           setup_states->push(StateInfo());
           pos.do_move(move_data.pv_data[other], setup_states->top());
         }
-        ss[0].evaluated = false;
         const Value value =
           (root_color == pos.side_to_move())
           ?
-          Eval::evaluate(pos, ss + 1)
+          Eval::evaluate(pos)
           :
-          -Eval::evaluate(pos, ss + 1);
+          -Eval::evaluate(pos);
         const double diff = value - record_value;
         const double dt = (root_color == kBlack) ? dsigmoid(diff) : -dsigmoid(diff);
         PRINT_PV(std::cout << ", value: " << value << ", dT: " << dt << std::endl);
@@ -1359,7 +1355,7 @@ Learner::add_part_param()
           if (i == j)
           {
             if (!Divide)
-              Eval::KPP[king][i][j] = 0;
+              Eval::KPP[king][Eval::kpp_index(i, j)] = 0;
             continue;
           }
 
@@ -1798,8 +1794,9 @@ Learner::add_part_param()
               ++part_num;
             }
           }
-          if (!Divide)
-            Eval::KPP[king][i][j] = static_cast<int16_t>((std::round(static_cast<double>(kpp_tmp) / static_cast<double>(part_num))));
+          // KPPは三角形に詰めているので、i > jの組だけを書き込む
+          if (!Divide && i > j)
+            Eval::KPP[king][Eval::kpp_index(i, j)] = static_cast<int16_t>((std::round(static_cast<double>(kpp_tmp) / static_cast<double>(part_num))));
         }
       }
     }
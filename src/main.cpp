@@ -20,6 +20,7 @@
 
 #include "bit_board.h"
 #include "evaluate.h"
+#include "mate_solver.h"
 #include "position.h"
 #include "search.h"
 #include "thread.h"
@@ -42,6 +43,8 @@ main(int argc, char* argv[])
   Threads.init();
 
   TT.resize(Options["USI_Hash"]);
+  Eval::EH.resize(Options["EvalHash"]);
+  Mate.resize(Options["MateHash"]);
 
   if (Options["OwnBook"])
     Search::BookManager.open(Options["BookFile"]);
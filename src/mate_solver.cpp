@@ -0,0 +1,390 @@
+/*
+  nozomi, a USI shogi playing engine
+  Copyright (C) 2016 Yuhei Ohmori
+
+  nozomi is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  nozomi is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cassert>
+
+#include "mate_solver.h"
+#include "move_generator.h"
+#include "position.h"
+#include "search.h"
+
+MateSolver Mate;
+
+namespace
+{
+const uint32_t kInfinite = 0xffffffffU;
+
+// 有限の値の和はkInfinite - 1で止める
+inline uint32_t
+add_number(uint32_t a, uint32_t b)
+{
+  if (a == kInfinite || b == kInfinite)
+    return kInfinite;
+
+  return static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(a) + b, kInfinite - 1));
+}
+
+// 詰みを調べるときに読む手を生成する
+// 攻め方は王手だけ、玉方は合法手すべて
+ExtMove *
+generate_mate_moves(const Position &pos, bool or_node, ExtMove *mlist)
+{
+  const bool in_check = pos.in_check();
+  ExtMove *end =
+    or_node && !in_check
+    ?
+    generate<kChecks>(pos, mlist)
+    :
+    generate<kLegal>(pos, mlist);
+
+  ExtMove *cur = mlist;
+  if (or_node)
+  {
+    BitBoard pinned = pos.pinned_pieces(pos.side_to_move());
+    CheckInfo ci(pos);
+    while (cur != end)
+    {
+      // 攻め方が王手をかけられているときは王手を外しながら王手をかける手だけを残す
+      if
+      (
+        (!in_check && !pos.legal(cur->move, pinned))
+        ||
+        (in_check && !pos.gives_check(cur->move, ci))
+      )
+        cur->move = (--end)->move;
+      else
+        ++cur;
+    }
+  }
+
+  return end;
+}
+} // namespace
+
+void
+MateSolver::resize(size_t mb_size)
+{
+  mb_size_ = mb_size;
+  std::vector<Cluster>().swap(table_);
+}
+
+void
+MateSolver::clear()
+{
+  if (!table_.empty())
+    std::fill(table_.begin(), table_.end(), Cluster());
+}
+
+const MateSolver::Entry *
+MateSolver::lookup(Key key) const
+{
+  const Cluster &cluster = table_[mul_hi64(key, table_.size())];
+  for (int i = 0; i < kClusterSize; ++i)
+  {
+    const Entry &e = cluster.entry[i];
+    // 前のsolve()の手順による反証は使わない
+    if (e.key == key && (e.pn | e.dn) != 0 && (e.loop_id == 0 || e.loop_id == solve_id_))
+      return &e;
+  }
+  return nullptr;
+}
+
+void
+MateSolver::store(Key key, uint32_t pn, uint32_t dn, uint16_t mate_ply, bool loop, uint64_t searched)
+{
+  Cluster &cluster = table_[mul_hi64(key, table_.size())];
+  Entry *replace = &cluster.entry[0];
+  for (int i = 0; i < kClusterSize; ++i)
+  {
+    Entry &e = cluster.entry[i];
+    if (e.key == key || (e.pn | e.dn) == 0)
+    {
+      replace = &e;
+      if (e.key == key)
+        searched += e.searched;
+      break;
+    }
+
+    // 証明か反証の済んだエントリは捨てにくくするため、調べた局面数の少ないものから置き換える
+    if (e.searched < replace->searched)
+      replace = &e;
+  }
+
+  replace->key = key;
+  replace->pn = pn;
+  replace->dn = dn;
+  replace->mate_ply = mate_ply;
+  replace->loop_id = loop ? solve_id_ : 0;
+  replace->searched = static_cast<uint32_t>(std::min<uint64_t>(searched, 0xffffffffU));
+}
+
+bool
+MateSolver::in_path(Key key) const
+{
+  return std::find(path_.begin(), path_.end(), key) != path_.end();
+}
+
+bool
+MateSolver::should_stop()
+{
+  if
+  (
+    Search::Signals.stop
+    ||
+    (max_nodes_ != 0 && nodes_ >= max_nodes_)
+    ||
+    (time_limit_ != 0 && now() - start_time_ >= time_limit_)
+  )
+    stopped_ = true;
+
+  return stopped_;
+}
+
+void
+MateSolver::search(Position &pos, bool or_node, uint32_t thpn, uint32_t thdn, int ply)
+{
+  const Key key = pos.key();
+  const uint64_t start_nodes = nodes_++;
+
+  if ((nodes_ & 1023) == 0)
+    should_stop();
+
+  ExtMove *first = &moves_[ply * kMaxMoves];
+  ExtMove *last = generate_mate_moves(pos, or_node, first);
+
+  // 王手がなければ不詰、王手を外す手がなければ詰み
+  if (first == last)
+  {
+    if (or_node)
+      store(key, kInfinite, 0, 0, false, 1);
+    else
+      store(key, 0, kInfinite, 0, false, 1);
+    return;
+  }
+
+  path_.push_back(key);
+
+  uint32_t pn;
+  uint32_t dn;
+  uint16_t mate_ply = 0;
+  bool loop = false;
+  StateInfo st;
+  while (true)
+  {
+    // 子局面の証明数と反証数を集める
+    // 攻め方の局面ではpnが最小、dnが和になる(玉方の局面はその逆)
+    uint32_t best_number = kInfinite;   // 攻め方ならpn、玉方ならdnの最小値
+    uint32_t second_number = kInfinite;
+    uint32_t best_other = 0;            // best_moveの、最小値を取らない方の値
+    uint32_t sum = 0;
+    uint16_t child_mate_ply = or_node ? 0xffff : 0;
+    Move best_move = kMoveNone;
+    bool loop_disproof = false;   // 手順による反証の子がある
+    bool fixed_disproof = false;  // 手順によらない反証の子がある
+
+    for (ExtMove *m = first; m != last; ++m)
+    {
+      uint32_t cpn = 1;
+      uint32_t cdn = 1;
+      uint16_t cply = 0;
+      bool cloop = false;
+      const Key child_key = pos.key_after(m->move);
+
+      // 王手の千日手と深すぎる手順は詰まないものとする
+      if (ply + 1 >= kMaxSolvePly || in_path(child_key))
+      {
+        cpn = kInfinite;
+        cdn = 0;
+        cloop = true;
+      }
+      else if (const Entry *e = lookup(child_key))
+      {
+        cpn = e->pn;
+        cdn = e->dn;
+        cply = e->mate_ply;
+        cloop = e->loop_id != 0;
+      }
+
+      if (cdn == 0)
+      {
+        if (cloop)
+          loop_disproof = true;
+        else
+          fixed_disproof = true;
+      }
+
+      const uint32_t number = or_node ? cpn : cdn;
+      const uint32_t other = or_node ? cdn : cpn;
+      if (number < best_number)
+      {
+        second_number = best_number;
+        best_number = number;
+        best_other = other;
+        best_move = m->move;
+      }
+      else if (number < second_number)
+      {
+        second_number = number;
+      }
+      sum = add_number(sum, other);
+
+      if (cpn == 0)
+        child_mate_ply =
+          or_node
+          ?
+          std::min(child_mate_ply, cply)
+          :
+          std::max(child_mate_ply, cply);
+    }
+
+    pn = or_node ? best_number : sum;
+    dn = or_node ? sum : best_number;
+    if (pn == 0)
+      mate_ply = child_mate_ply + 1;
+
+    // 攻め方の局面は子の反証を全部使い、玉方の局面は手順によらない反証が1つあればよい
+    loop =
+      dn == 0
+      &&
+      (
+        or_node
+        ?
+        loop_disproof
+        :
+        !fixed_disproof
+      );
+
+    if (pn >= thpn || dn >= thdn || stopped_)
+      break;
+
+    // 一番良い子局面を、二番目の子局面を超えるかこの局面の閾値を超えるまで調べる
+    const uint32_t th_number =
+      std::min(or_node ? thpn : thdn, second_number == kInfinite ? kInfinite : second_number + 1);
+    const uint32_t th_sum = or_node ? thdn : thpn;
+    const uint32_t th_other =
+      th_sum == kInfinite
+      ?
+      kInfinite
+      :
+      th_sum - sum + best_other;
+
+    pos.do_move(best_move, st);
+    if (or_node)
+      search(pos, false, th_number, th_other, ply + 1);
+    else
+      search(pos, true, th_other, th_number, ply + 1);
+    pos.undo_move(best_move);
+  }
+
+  path_.pop_back();
+  store(key, pn, dn, mate_ply, loop, nodes_ - start_nodes);
+}
+
+bool
+MateSolver::extract_pv(Position &pos, bool or_node, int ply, std::vector<Move> *pv)
+{
+  if (ply >= kMaxSolvePly)
+    return false;
+
+  ExtMove *first = &moves_[ply * kMaxMoves];
+  ExtMove *last = generate_mate_moves(pos, or_node, first);
+  if (first == last)
+    return !or_node;
+
+  // 攻め方は一番早く詰む手、玉方は一番長く逃れる手を選ぶ
+  Move best_move = kMoveNone;
+  int best_ply = or_node ? kMaxSolvePly : -1;
+  for (ExtMove *m = first; m != last; ++m)
+  {
+    const Key child_key = pos.key_after(m->move);
+    if (in_path(child_key))
+      continue;
+
+    const Entry *e = lookup(child_key);
+    if (e == nullptr || e->pn != 0)
+      continue;
+
+    if
+    (
+      (or_node && e->mate_ply < best_ply)
+      ||
+      (!or_node && e->mate_ply > best_ply)
+    )
+    {
+      best_ply = e->mate_ply;
+      best_move = m->move;
+    }
+  }
+
+  if (best_move == kMoveNone)
+    return false;
+
+  StateInfo st;
+  path_.push_back(pos.key());
+  pv->push_back(best_move);
+  pos.do_move(best_move, st);
+  const bool result = extract_pv(pos, !or_node, ply + 1, pv);
+  pos.undo_move(best_move);
+  path_.pop_back();
+  return result;
+}
+
+MateSolver::Result
+MateSolver::solve(Position &pos, uint64_t max_nodes, int time_limit, std::vector<Move> *pv)
+{
+  if (table_.empty())
+  {
+    // 2のべき乗でなくてもmul_hi64で割り当てられるので、そのまま使う
+    const size_t count = std::max<size_t>(mb_size_ * 1024 * 1024 / sizeof(Cluster), 1024);
+    table_.resize(count);
+  }
+  if (moves_.empty())
+    moves_.resize(static_cast<size_t>(kMaxSolvePly + 1) * kMaxMoves);
+
+  nodes_ = 0;
+  max_nodes_ = max_nodes;
+  time_limit_ = time_limit;
+  start_time_ = now();
+  stopped_ = false;
+  path_.clear();
+  // 番号が一周したら、古い手順による反証と区別できなくなるので表を空にする
+  if (++solve_id_ == 0)
+  {
+    clear();
+    ++solve_id_;
+  }
+
+  search(pos, true, kInfinite, kInfinite, 0);
+
+  const Entry *root = lookup(pos.key());
+  if (root == nullptr || (root->pn != 0 && root->dn != 0))
+    return kUnknown;
+
+  if (root->dn == 0)
+    return root->loop_id == 0 ? kNoMate : kUnknown;
+
+  if (pv != nullptr)
+  {
+    pv->clear();
+    path_.clear();
+    if (!extract_pv(pos, true, 0, pv))
+      pv->clear();
+  }
+  return kMate;
+}
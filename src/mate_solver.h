@@ -0,0 +1,125 @@
+/*
+  nozomi, a USI shogi playing engine
+  Copyright (C) 2016 Yuhei Ohmori
+
+  nozomi is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  nozomi is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MATE_SOLVER_H_
+#define _MATE_SOLVER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "misc.h"
+#include "types.h"
+#include "move.h"
+
+class Position;
+
+// df-pn(証明数と反証数による深さ優先探索)で詰みを調べる
+// 証明数と反証数は攻め方から見た数で、攻め方の局面(OR)は王手、玉方の局面(AND)は王手を外す手だけを読む
+// 調べた局面の証明数と反証数は専用の表に置き、置換表とは分ける
+// 千日手や手数の上限で不詰とした結果は手順によるので、その下の反証には印を付け、
+// 同じsolve()の中でだけ使い、根の反証が印付きならkNoMateではなくkUnknownを返す
+// 表は1つのスレッドからしか使わない(go mateと探索中の詰み探索スレッドは同時には動かない)
+class MateSolver
+{
+public:
+  enum Result
+  {
+    kMate,      // 詰む
+    kNoMate,    // 詰まない
+    kUnknown    // 打ち切った
+  };
+
+  // 表の大きさを決める(実際に確保するのは最初にsolve()を呼んだとき)
+  void
+  resize(size_t mb_size);
+
+  void
+  clear();
+
+  // posの手番側が相手の玉を詰ませるか調べる
+  // 詰めば*pvに詰み手順を入れる
+  // Signals.stopがtrueになるか、max_nodes局面かtime_limitミリ秒(0なら制限なし)を超えたら打ち切る
+  Result
+  solve(Position &pos, uint64_t max_nodes, int time_limit, std::vector<Move> *pv);
+
+  uint64_t
+  nodes() const
+  {
+    return nodes_;
+  }
+
+private:
+  // 1つのエントリ(24byte)
+  struct Entry
+  {
+    Key      key;
+    uint32_t pn;
+    uint32_t dn;
+    uint32_t searched;   // この局面の下で調べた局面数(置き換えに使う)
+    uint16_t mate_ply;   // 詰みを証明したときの詰みまでの手数
+    uint16_t loop_id;    // 手順による反証ならそのsolve()の番号(0なら手順によらない)
+  };
+
+  static const int
+  kClusterSize = 4;
+
+  // これより深い手順は詰まないものとして扱う
+  static const int
+  kMaxSolvePly = 256;
+
+  struct Cluster
+  {
+    Entry entry[kClusterSize];
+  };
+
+  const Entry *
+  lookup(Key key) const;
+
+  void
+  store(Key key, uint32_t pn, uint32_t dn, uint16_t mate_ply, bool loop, uint64_t searched);
+
+  // 局面posを閾値(thpn, thdn)まで調べる
+  void
+  search(Position &pos, bool or_node, uint32_t thpn, uint32_t thdn, int ply);
+
+  // 証明済みの局面から詰み手順を取り出す
+  bool
+  extract_pv(Position &pos, bool or_node, int ply, std::vector<Move> *pv);
+
+  // keyが今の手順の中に出てきたか(連続王手の千日手)
+  bool
+  in_path(Key key) const;
+
+  bool
+  should_stop();
+
+  std::vector<Cluster> table_;
+  size_t               mb_size_ = 0;
+  std::vector<Key>     path_;
+  std::vector<ExtMove> moves_;        // ply毎にkMaxMoves個ずつ使う指し手の置き場
+  uint64_t             nodes_ = 0;
+  uint64_t             max_nodes_ = 0;
+  TimePoint            start_time_ = 0;
+  int                  time_limit_ = 0;
+  bool                 stopped_ = false;
+  uint16_t             solve_id_ = 0;
+};
+
+extern MateSolver Mate;
+
+#endif
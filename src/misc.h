@@ -81,12 +81,26 @@ msb(uint64_t b)
   _BitScanReverse64(&index, b);
   return (int)index;
 }
+
+// a * b の上位64bit
+inline uint64_t
+mul_hi64(uint64_t a, uint64_t b)
+{
+  return __umulh(a, b);
+}
 #else
 inline int
 msb(uint64_t b)
 {
   return (int)(63 - __builtin_clzll(b));
 }
+
+// a * b の上位64bit
+inline uint64_t
+mul_hi64(uint64_t a, uint64_t b)
+{
+  return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+}
 #endif
 
 #endif
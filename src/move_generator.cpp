@@ -2509,3 +2509,101 @@ search_mate1ply(Position &pos)
 
   return kMoveNone;
 }
+
+bool
+defender_is_mated(Position &pos, int ply, int *nodes, MateCache *cache);
+
+Move
+search_mateNply(Position &pos, int ply, int *nodes, MateCache *cache, bool mate1ply)
+{
+  const Key key = pos.key();
+  Move move;
+  if (cache != nullptr && cache->probe(key, ply, &move))
+    return move;
+
+  // 王手をかけられていなければ、まず安い1手詰めを調べる
+  const bool in_check = pos.in_check();
+  if (!in_check)
+  {
+    move = mate1ply ? search_mate1ply(pos) : kMoveNone;
+    if (move != kMoveNone || ply <= 1)
+      return move;
+  }
+
+  ExtMove mlist[kMaxMoves];
+  ExtMove *end =
+    in_check
+    ?
+    generate<kEvasions>(pos, mlist)
+    :
+    generate<kChecks>(pos, mlist);
+
+  const Color us = pos.side_to_move();
+  BitBoard pinned = pos.pinned_pieces(us);
+  CheckInfo ci(pos);
+  move = kMoveNone;
+  for (ExtMove *cur = mlist; cur != end; ++cur)
+  {
+    const Move m = cur->move;
+    if (!pos.legal(m, pinned))
+      continue;
+
+    // 王手を外しながらの王手だけを読む(打ち歩詰めになる歩は打たない)
+    if
+    (
+      in_check
+      &&
+      (
+        !pos.gives_check(m, ci)
+        ||
+        (move_from(m) >= kBoardSquare && to_drop_piece_type(move_from(m)) == kPawn && pos.gives_mate_by_drop_pawn(move_to(m)))
+      )
+    )
+      continue;
+
+    if (--*nodes < 0)
+      return kMoveNone;
+
+    StateInfo st;
+    pos.do_move(m, st, true);
+    const bool mated = defender_is_mated(pos, ply - 1, nodes, cache);
+    pos.undo_move(m);
+    if (mated)
+    {
+      move = m;
+      break;
+    }
+  }
+
+  // 局面数を使い切ったときの不詰は確かではないので覚えない
+  if (cache != nullptr && *nodes >= 0)
+    cache->save(key, ply, move);
+
+  return move;
+}
+
+// 王手をかけられた側のすべての合法手に、この局面からply手以内の詰みがあるか
+bool
+defender_is_mated(Position &pos, int ply, int *nodes, MateCache *cache)
+{
+  ExtMove mlist[kMaxMoves];
+  ExtMove *end = generate<kEvasions>(pos, mlist);
+  BitBoard pinned = pos.pinned_pieces(pos.side_to_move());
+  for (ExtMove *cur = mlist; cur != end; ++cur)
+  {
+    const Move m = cur->move;
+    if (!pos.legal(m, pinned))
+      continue;
+
+    if (ply <= 0 || --*nodes < 0)
+      return false;
+
+    StateInfo st;
+    pos.do_move(m, st);
+    const bool mate = search_mateNply(pos, ply - 1, nodes, cache) != kMoveNone;
+    pos.undo_move(m);
+    if (!mate)
+      return false;
+  }
+  return true;
+}
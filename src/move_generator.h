@@ -48,6 +48,77 @@ generate(const Position &pos, ExtMove *mlist);
 Move
 search_mate1ply(Position &pos);
 
+// search_mateNplyの結果を覚えておく小さな表(スレッドごとに持つ)
+// 詰みはそれより長い手数で調べたときにも、不詰はそれより短い手数で調べたときにも使える
+class MateCache
+{
+public:
+  MateCache()
+  {
+    clear();
+  }
+
+  void
+  clear()
+  {
+    for (Entry &e : entries_)
+      e = Entry{0, kMoveNone, 0};
+  }
+
+  // 使える結果があればtrueを返し、*moveに詰ませる手(不詰ならkMoveNone)を入れる
+  bool
+  probe(Key key, int ply, Move *move) const
+  {
+    const Entry &e = entries_[key & (kSize - 1)];
+    if (e.key != key || e.ply == 0)
+      return false;
+
+    if
+    (
+      (e.move != kMoveNone && ply >= e.ply)
+      ||
+      (e.move == kMoveNone && ply <= e.ply)
+    )
+    {
+      *move = e.move;
+      return true;
+    }
+    return false;
+  }
+
+  void
+  save(Key key, int ply, Move move)
+  {
+    entries_[key & (kSize - 1)] = Entry{key, move, ply};
+  }
+
+private:
+  static const int
+  kSize = 4096;
+
+  struct Entry
+  {
+    Key  key;
+    Move move;
+    int  ply;
+  };
+
+  Entry entries_[kSize];
+};
+
+// 攻め方の手番でply手(奇数)以内に詰む手を探す
+// 王手と王手を外す手をすべて読むが、末端の1手詰めはsearch_mate1plyに任せる
+// *nodesは調べてよい局面数で、使い切ったら詰まないものとして返す
+// 呼び出し側でこの局面の1手詰めを調べ済みなら、mate1plyをfalseにして調べ直さない
+Move
+search_mateNply(Position &pos, int ply, int *nodes, MateCache *cache = nullptr, bool mate1ply = true);
+
+inline Move
+search_mate3ply(Position &pos, int *nodes, MateCache *cache = nullptr)
+{
+  return search_mateNply(pos, 3, nodes, cache);
+}
+
 template<GenType T>
 struct MoveList
 {
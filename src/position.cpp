@@ -390,6 +390,70 @@ Position::set(const std::string &sfen, Thread *t)
   }
 }
 
+string
+Position::sfen() const
+{
+  const char *piece_name = " PLNSBRGK";
+  const PieceType hand_order[] = { kRook, kBishop, kGold, kSilver, kKnight, kLance, kPawn };
+  std::ostringstream ss;
+
+  for (int rank = 0; rank < kNumberOfRank; ++rank)
+  {
+    int empty = 0;
+    for (int file = 0; file < kNumberOfFile; ++file)
+    {
+      const Piece p = squares_[rank * kNumberOfFile + file];
+      if (p == kEmpty)
+      {
+        ++empty;
+        continue;
+      }
+
+      if (empty)
+      {
+        ss << empty;
+        empty = 0;
+      }
+
+      const PieceType t = type_of(p);
+      char c = piece_name[t >= kPromotedPawn ? unpromote_piece_type(t) : t];
+      if (t >= kPromotedPawn)
+        ss << '+';
+      ss << static_cast<char>(color_of(p) == kBlack ? c : tolower(c));
+    }
+
+    if (empty)
+      ss << empty;
+    if (rank != kRank9)
+      ss << '/';
+  }
+
+  ss << (side_to_move_ == kBlack ? " b " : " w ");
+
+  bool hand_empty = true;
+  for (Color c = kBlack; c < kNumberOfColor; ++c)
+  {
+    for (PieceType t : hand_order)
+    {
+      const int n = number_of(hand_[c], t);
+      if (n == 0)
+        continue;
+
+      if (n > 1)
+        ss << n;
+      ss << static_cast<char>(c == kBlack ? piece_name[t] : tolower(piece_name[t]));
+      hand_empty = false;
+    }
+  }
+
+  if (hand_empty)
+    ss << '-';
+
+  ss << " " << game_ply_ + 1;
+
+  return ss.str();
+}
+
 Position &
 Position::operator=(const Position &pos)
 {
@@ -440,6 +504,8 @@ Position::do_move(Move m, StateInfo &new_state, bool gives_check)
 
   std::memcpy(&new_state, state_, offsetof(StateInfo, list_index_capture));
   new_state.previous = state_;
+  new_state.last_move = m;
+  new_state.evaluated = false;
   state_ = &new_state;
 
   ++state_->pilies_from_null;
@@ -542,7 +608,7 @@ Position::do_move(Move m, StateInfo &new_state, bool gives_check)
       state_->list_index_move = kpp_index;
     }
   }
-  prefetch(TT.first_entry(board_key + hand_key));
+  prefetch(TT.first_entry(board_key, hand_key));
   state_->board_key = board_key;
   state_->hand_key = hand_key;
   state_->hand_black = hand_[kBlack];
@@ -564,10 +630,11 @@ Position::do_null_move(StateInfo &new_state)
 {
   memcpy(&new_state, state_, sizeof(StateInfo));
   new_state.previous = state_;
+  new_state.last_move = kMoveNull;
   state_ = &new_state;
 
   state_->board_key ^= Zobrist::side;
-  prefetch(TT.first_entry(key()));
+  prefetch(TT.first_entry(state_->board_key, state_->hand_key));
 
   side_to_move_ = ~side_to_move_;
 }
@@ -1256,6 +1323,50 @@ Position::exclusion_key() const
   return (state_->board_key + state_->hand_key) ^ Zobrist::exclusion;
 }
 
+// mを指した後の局面のキー
+// do_moveより前に子局面の置換表などを先読みするために使う
+void
+Position::keys_after(Move m, uint64_t *board_key_after, uint64_t *hand_key_after) const
+{
+  const Color  us   = side_to_move_;
+  const Square from = move_from(m);
+  const Square to   = move_to(m);
+  uint64_t board_key = state_->board_key ^ Zobrist::side;
+  uint64_t hand_key  = state_->hand_key;
+
+  if (from >= kBoardSquare)
+  {
+    const PieceType drop = to_drop_piece_type(from);
+    hand_key  -= Zobrist::hands[us][drop];
+    board_key += Zobrist::tables[us][drop][to];
+  }
+  else
+  {
+    const PieceType piece_move = move_piece_type(m);
+    board_key -= Zobrist::tables[us][piece_move][from];
+    board_key += Zobrist::tables[us][move_is_promote(m) ? piece_move + kFlagPromoted : piece_move][to];
+
+    const PieceType piece_capture = move_capture(m);
+    if (piece_capture != kPieceNone)
+    {
+      board_key -= Zobrist::tables[~us][piece_capture][to];
+      hand_key  += Zobrist::hands[us][piece_capture & 0x7];
+    }
+  }
+
+  *board_key_after = board_key;
+  *hand_key_after  = hand_key;
+}
+
+uint64_t
+Position::key_after(Move m) const
+{
+  uint64_t board_key;
+  uint64_t hand_key;
+  keys_after(m, &board_key, &hand_key);
+  return board_key + hand_key;
+}
+
 
 Repetition 
 Position::in_repetition() const
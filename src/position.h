@@ -66,6 +66,13 @@ struct StateInfo
   Hand     hand_black;
   BitBoard checkers_bb;
   StateInfo *previous;
+
+  // 評価関数の差分計算用
+  Move  last_move;
+  Value black_kpp;
+  Value white_kpp;
+  Value kkp;
+  bool  evaluated;
 };
 
 class Position
@@ -95,6 +102,8 @@ public:
   // Text input/output
   void 
   set(const std::string &sfen, Thread *t);
+  std::string
+  sfen() const;
 
   // Position representation
   BitBoard 
@@ -164,6 +173,10 @@ public:
 
   uint64_t
   key() const;
+  uint64_t
+  board_key() const;
+  uint64_t
+  hand_key() const;
   int 
   material() const;
   Value 
@@ -177,6 +190,10 @@ public:
   in_repetition() const;
   uint64_t 
   exclusion_key() const;
+  void
+  keys_after(Move m, uint64_t *board_key, uint64_t *hand_key) const;
+  uint64_t
+  key_after(Move m) const;
   int 
   continuous_checks(Color c) const;
 
@@ -184,14 +201,8 @@ public:
   black_kpp_list() const;
   int *
   white_kpp_list() const;
-  int *
-  prev_black_kpp_list() const;
-  int *
-  prev_white_kpp_list() const;
-  int
-  list_index_capture() const;
-  int
-  list_index_move() const;
+  StateInfo *
+  state() const;
 
   void
   print() const;
@@ -366,6 +377,18 @@ Position::key() const
   return state_->board_key + state_->hand_key;
 }
 
+inline uint64_t
+Position::board_key() const
+{
+  return state_->board_key;
+}
+
+inline uint64_t
+Position::hand_key() const
+{
+  return state_->hand_key;
+}
+
 inline int
 Position::material() const
 {
@@ -460,28 +483,10 @@ Position::white_kpp_list() const
   return state_->white_kpp_list;
 }
 
-inline int *
-Position::prev_black_kpp_list() const
-{
-  return state_->previous->black_kpp_list;
-}
-
-inline int *
-Position::prev_white_kpp_list() const
-{
-  return state_->previous->white_kpp_list;
-}
-
-inline int
-Position::list_index_capture() const
-{
-  return state_->list_index_capture;
-}
-
-inline int
-Position::list_index_move() const
+inline StateInfo *
+Position::state() const
 {
-  return state_->list_index_move;
+  return state_;
 }
 
 #endif
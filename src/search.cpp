@@ -28,8 +28,11 @@
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 #include "evaluate.h"
+#include "mate_solver.h"
 #include "move_generator.h"
 #include "move_picker.h"
 #include "search.h"
@@ -119,10 +122,89 @@ HalfDensity[] =
 
 const size_t HalfDensitySize = std::extent<decltype(HalfDensity)>::value;
 
+// Lazy SMPのhelper threadの分担のしかた(USIのSmpHelper)
+//   HalfDensity  HalfDensityの表で深さを飛ばす
+//   DepthOffset  主スレッドの終えた深さより1手か2手深いところから始める
+//   ABDADA       全員同じ深さを探索し、他のスレッドが探索中の子局面は後回しにする
+enum SmpHelperPolicy
+{
+  kHelperHalfDensity,
+  kHelperDepthOffset,
+  kHelperAbdada
+};
+
+SmpHelperPolicy HelperPolicy = kHelperHalfDensity;
+
+// 探索の中で調べる詰みの手数(USIのMatePly、1、3、5、7のどれか)
+// 1なら今までどおり1手詰めだけを調べる
+int MatePly = 1;
+
+// 3手以上の詰みを調べるときに1回で読んでよい局面数
+const int kMateNplyNodes = 128;
+
+// ABDADAで探索中の子局面を書いておく表
+// 置換表のエントリには空いているbitがない(クラスタの形によってはkeyも一部しかない)ので、
+// 置換表とは別の小さな表に、keyの上位とスレッド番号(下位7bit)を書く
+// 浅いところは数が多くすぐ終わるので、kAbdadaDepth以上の局面だけを書く
+const Depth kAbdadaDepth = Depth(4 * kOnePly);
+
+class BusyTable
+{
+public:
+  // 他のスレッドがkeyの局面を探索中ならtrue
+  bool
+  busy(Key key, size_t thread_index) const
+  {
+    const Key v = keys_[key & kMask].load(std::memory_order_relaxed);
+    return (v & ~kThreadMask) == (key & ~kThreadMask) && (v & kThreadMask) != thread_index;
+  }
+
+  // 空いていれば書いてtrue(他のスレッドが使っていれば何もしない)
+  bool
+  mark(Key key, size_t thread_index)
+  {
+    Key empty = 0;
+    return keys_[key & kMask].compare_exchange_strong(empty, (key & ~kThreadMask) | thread_index, std::memory_order_relaxed);
+  }
+
+  void
+  unmark(Key key)
+  {
+    keys_[key & kMask].store(0, std::memory_order_relaxed);
+  }
+
+private:
+  static const size_t kSize       = 1 << 14;
+  static const Key    kMask       = kSize - 1;
+  static const Key    kThreadMask = 0x7f; // Threadsの最大128
+
+  std::atomic<Key> keys_[kSize];
+};
+
+BusyTable Busy;
+
+// MultiPVの行をスレッドに分けて探索する(USIのMultiPVSplit)
+// 深さごとに、前の深さの順位で並べた指し手と行番号(pv_index)を1つずつ配る
+// 全部の行が返ってきたら、最後に返したスレッドが結果をまとめて次の深さに進める
+// 読み筋の表示と時間の管理は主スレッドがまとめた結果を見て行う
+// 配る行のないスレッドはcvで眠り、行を配り直したときに起こす
+struct LineBoard
+{
+  std::mutex              mutex;
+  std::condition_variable cv;
+  Depth                  depth;      // 配っている深さ
+  size_t                 next;       // 次に配る行
+  size_t                 done;       // 返ってきた行の数
+  Search::RootMoveVector order;      // 配るときの順位
+  Search::RootMoveVector results;    // この深さの行ごとの結果
+  Depth                  completed;  // まとめ終えた深さ
+  Search::RootMoveVector best;       // completedの深さの順位
+};
+
+bool      SplitMultiPV = false;
+LineBoard Lines;
+
 Value                   DrawValue[kNumberOfColor];
-#ifndef LEARN
-CounterMoveHistoryStats CounterMoveHistory;
-#endif
 
 template <NodeType NT>
 Value 
@@ -151,6 +233,21 @@ value_from_tt(Value v, int ply);
 void
 update_pv(Move *pv, Move move, Move *child_pv);
 
+void
+qsearch_save
+(
+  const Position &pos,
+  TTSlot tte,
+  TTEntry *qs_entry,
+  Key key,
+  Value v,
+  Bound b,
+  Depth d,
+  Move m,
+  Value ev,
+  uint8_t g
+);
+
 void 
 update_stats
 (
@@ -168,6 +265,17 @@ update_stats
 
 void
 check_time();
+
+void
+report_mate(Position &pos);
+
+void
+mate_thread_search(Position pos);
+
+#ifndef LEARN
+void
+search_lines(Thread *th, SearchStack *ss);
+#endif
 } // namespace
 
 string
@@ -212,13 +320,22 @@ Search::clear()
 {
   TT.clear();
 #ifndef LEARN
-  CounterMoveHistory.clear();
+  // 1スレッドあたり25MBあるので、スレッドの数だけ並べて消す
+  // ページは各スレッドが最初に触ったときのNUMAノードにあるので、どこから消してもよい
+  std::vector<std::thread> clear_threads;
+  for (Thread *th : Threads)
+    clear_threads.emplace_back([th] { th->counter_move_history_->clear(); });
+  for (auto &t : clear_threads)
+    t.join();
 #endif
   for (Thread *th : Threads)
   {
     th->history_.clear();
     th->counter_moves_.clear();
+    th->qsearch_cache_.clear();
+    th->mate_cache_.clear();
   }
+  Mate.clear();
 
   Threads.main()->previous_score = kValueInfinite;
 }
@@ -226,9 +343,17 @@ Search::clear()
 void
 MainThread::search()
 {
+  // go mateのときは詰みだけを調べてcheckmateを返す(bestmoveは返さない)
+  if (Limits.solve_mate)
+  {
+    report_mate(root_pos_);
+    return;
+  }
+
   Color us = root_pos_.side_to_move();
   Time.init(Limits, us);
   bool search_best_thread = true;
+  std::thread mate_thread;
   int contempt = Options["Contempt"] * Eval::kPawnValue / 100; // From centipawns
   DrawValue[us] = kValueDraw - Value(contempt);
   DrawValue[~us] = kValueDraw + Value(contempt);
@@ -254,6 +379,33 @@ MainThread::search()
       }
     }
 
+    const string helper = Options["SmpHelper"];
+    HelperPolicy =
+      helper == "DepthOffset"
+      ?
+      kHelperDepthOffset
+      :
+      helper == "ABDADA"
+      ?
+      kHelperAbdada
+      :
+      kHelperHalfDensity;
+    MatePly = std::stoi(static_cast<string>(Options["MatePly"]));
+
+    // 行が1つしかないときやスレッドが1つのときは今までどおり
+    const size_t lines = std::min<size_t>(Options["MultiPV"], root_moves_.size());
+    SplitMultiPV = Options["MultiPVSplit"] && Threads.size() > 1 && lines > 1;
+    if (SplitMultiPV)
+    {
+      Lines.depth = kOnePly;
+      Lines.next = 0;
+      Lines.done = 0;
+      Lines.order = root_moves_;
+      Lines.results.assign(lines, RootMove(kMoveNone));
+      Lines.completed = kDepthZero;
+      Lines.best = root_moves_;
+    }
+
     for (Thread *th : Threads)
     {
       th->max_ply_ = 0;
@@ -266,6 +418,10 @@ MainThread::search()
       }
     }
 
+    // 探索と並べて詰みを調べ、見つけたら置換表に書く
+    if (Options["MateThread"])
+      mate_thread = std::thread(mate_thread_search, Position(root_pos_, this));
+
     Thread::search();
   }
 
@@ -278,6 +434,9 @@ exit:
 
   Signals.stop = true;
 
+  if (mate_thread.joinable())
+    mate_thread.join();
+
   for (Thread *th : Threads)
   {
     if (th != this)
@@ -342,15 +501,29 @@ Thread::search()
 
   size_t multi_pv = Options["MultiPV"];
 
+  if (SplitMultiPV)
+  {
+    search_lines(this, ss);
+    return;
+  }
+
   while (++root_depth_ < kDepthMax && !Signals.stop && (!Limits.depth || root_depth_ < Limits.depth))
   {
-    if (!main_thread)
+    if (!main_thread && HelperPolicy == kHelperHalfDensity)
     {
       const Row &row = HalfDensity[(index_ - 1) % HalfDensitySize];
       if (row[(root_depth_ + root_pos_.game_ply()) % row.size()])
         continue;
     }
 
+    if (!main_thread && HelperPolicy == kHelperDepthOffset)
+    {
+      // 奇数番目は1手、偶数番目は2手先を読む
+      const Depth limit  = Limits.depth ? Depth(Limits.depth - 1) : Depth(kDepthMax - 1);
+      const Depth target = Depth(Threads.main()->completed_depth_ + static_cast<int>(1 + (index_ - 1) % 2) * kOnePly);
+      root_depth_ = std::max(root_depth_, std::min(target, limit));
+    }
+
     if (main_thread)
     {
       main_thread->best_move_changes *= 0.505;
@@ -510,7 +683,8 @@ search
   Move pv[kMaxPly + 1];
   Move quiets_searched[64];
   StateInfo st;
-  TTEntry *tte;
+  TTSlot tte;
+  TTEntry tt_data;
   Key position_key;
   Move tt_move;
   Move move;
@@ -537,6 +711,9 @@ search
 
   // Initialize node
   Thread *this_thread = pos.this_thread();
+#ifndef LEARN
+  CounterMoveHistoryStats &CounterMoveHistory = *this_thread->counter_move_history_;
+#endif
   in_check = pos.in_check();
   move_count = quiet_count = ss->move_count = 0;
   best_value = -kValueInfinite;
@@ -565,7 +742,7 @@ search
     // 探索の中断と千日手チェック
     Repetition repetition = ((ss - 1)->current_move != kMoveNull) ? pos.in_repetition() : kNoRepetition;
     if (Signals.stop.load(std::memory_order_relaxed) || repetition == kRepetition || ss->ply >= kMaxPly)
-      return ss->ply >= kMaxPly && !in_check ? evaluate(pos, ss) : DrawValue[pos.side_to_move()];
+      return ss->ply >= kMaxPly && !in_check ? evaluate(pos) : DrawValue[pos.side_to_move()];
 
     // 連続王手千日手
     if (repetition == kPerpetualCheckWin)
@@ -611,8 +788,8 @@ search
 
   // Transposition table lookup
   excluded_move = ss->excluded_move;
-  position_key = excluded_move ? pos.exclusion_key() : pos.key();
-  tte = TT.probe(position_key, &tt_hit);
+  position_key = TT.key(pos, excluded_move != kMoveNone);
+  tte = TT.probe(pos, position_key, &tt_hit, &tt_data, &this_thread->tt_stats_);
   tt_move = root_node
             ?
             this_thread->root_moves_[this_thread->pv_index_].pv[0]
@@ -620,11 +797,11 @@ search
             (
               tt_hit
               ?
-              tte->move(pos)
+              tt_data.move(pos)
               :
               kMoveNone
             );
-  tt_value = tt_hit ? value_from_tt(tte->value(), ss->ply) : kValueNone;
+  tt_value = tt_hit ? value_from_tt(tt_data.value(), ss->ply) : kValueNone;
 
   // PV nodeのときはtransposition tableの手を使用しない
   if
@@ -633,16 +810,16 @@ search
     &&
     tt_hit
     &&
-    tte->depth() >= depth
+    tt_data.depth() >= depth
     &&
     tt_value != kValueNone // transposition tableの値が壊れている時になりうる
     &&
     (
       tt_value >= beta
       ?
-      (tte->bound() & kBoundLower)
+      (tt_data.bound() & kBoundLower)
       :
-      (tte->bound() & kBoundUpper)
+      (tt_data.bound() & kBoundUpper)
     )
   )
   {
@@ -687,7 +864,7 @@ search
     if ((mate_move = search_mate1ply(pos)) != kMoveNone)
     {
       ss->static_eval = best_value = mate_in(ss->ply + 1);
-      tte->save
+      tte.save
       (
         position_key,
         value_to_tt(best_value, ss->ply),
@@ -700,6 +877,36 @@ search
 
       return best_value;
     }
+
+    // 1手詰めがなければ、局面数を決めてもう少し長い詰みを調べる
+    // 見つけてもbetaを超えなければ使えないので、先に確かめる(PV nodeでは調べない)
+    // 1手詰めはすぐ上で調べたので、search_mateNplyでは調べ直さない
+    int mate_nodes = kMateNplyNodes;
+    if
+    (
+      !pv_node
+      &&
+      MatePly > 1
+      &&
+      mate_in(ss->ply + MatePly) >= beta
+      &&
+      (mate_move = search_mateNply(pos, MatePly, &mate_nodes, &this_thread->mate_cache_, false)) != kMoveNone
+    )
+    {
+      best_value = mate_in(ss->ply + MatePly);
+      tte.save
+      (
+        position_key,
+        value_to_tt(best_value, ss->ply),
+        kBoundLower,
+        depth,
+        mate_move,
+        kValueNone,
+        TT.generation()
+      );
+
+      return best_value;
+    }
   }
 
   // 現局面の静的評価
@@ -710,12 +917,12 @@ search
   }
   else if (tt_hit)
   {
-    if ((ss->static_eval = eval = tte->eval_value()) == kValueNone)
-      eval = ss->static_eval = evaluate(pos, ss);
+    if ((ss->static_eval = eval = tt_data.eval_value()) == kValueNone)
+      eval = ss->static_eval = evaluate(pos);
 
     if (tt_value != kValueNone)
     {
-      if (tte->bound() & (tt_value > eval ? kBoundLower : kBoundUpper))
+      if (tt_data.bound() & (tt_value > eval ? kBoundLower : kBoundUpper))
         eval = tt_value;
     }
   }
@@ -724,10 +931,10 @@ search
     eval = ss->static_eval =
       (ss - 1)->current_move != kMoveNull
       ?
-      evaluate(pos, ss)
+      evaluate(pos)
       :
       -(ss - 1)->static_eval + 2 * Eval::kTempo;
-    tte->save(position_key, kValueNone, kBoundNone, kDepthNone, kMoveNone, ss->static_eval, TT.generation());
+    tte.save(position_key, kValueNone, kBoundNone, kDepthNone, kMoveNone, ss->static_eval, TT.generation());
   }
 
   if (ss->skip_early_pruning)
@@ -791,7 +998,6 @@ search
       = ((823 + 67 * depth) / 256 + std::min(int(eval - beta) / Eval::kPawnValue, 3)) * kOnePly;
 
     pos.do_null_move(st);
-    (ss + 1)->evaluated = false;
     (ss + 1)->skip_early_pruning = true;
     null_value =
       depth - re < kOnePly
@@ -880,7 +1086,6 @@ search
       {
         ss->current_move = move;
         pos.do_move(move, st);
-        (ss + 1)->evaluated = false;
         value = 
           -search<kNonPV>
           (
@@ -930,8 +1135,8 @@ search
     );
     ss->skip_early_pruning = false;
 
-    tte = TT.probe(position_key, &tt_hit);
-    tt_move = tt_hit ? tte->move(pos) : kMoveNone;
+    tte = TT.probe(pos, position_key, &tt_hit, &tt_data, &this_thread->tt_stats_);
+    tt_move = tt_hit ? tt_data.move(pos) : kMoveNone;
   }
 
 moves_loop:
@@ -947,6 +1152,27 @@ moves_loop:
   MovePicker mp(pos, tt_move, depth, this_thread->history_, cmh, fmh, countermove, ss);
   CheckInfo ci(pos);
   value = best_value;
+
+  // ABDADAで後回しにした手
+  // MovePickerが指し手を出し尽くしてから順に探索する(そのときはもう後回しにしない)
+  // 1局面の指し手はkMaxMoves個を超えないので、出てきた手は全部後回しにできる
+  const bool abdada = HelperPolicy == kHelperAbdada && depth >= kAbdadaDepth && Threads.size() > 1;
+  Move deferred_moves[kMaxMoves];
+  int  deferred_count = 0;
+  int  deferred_index = 0;
+  bool picker_done = false;
+  // MovePickerは出し尽くした後に呼ばない
+  auto next_move = [&]() -> Move
+  {
+    if (!picker_done)
+    {
+      const Move m = mp.next_move();
+      if (m != kMoveNone)
+        return m;
+      picker_done = true;
+    }
+    return deferred_index < deferred_count ? deferred_moves[deferred_index++] : kMoveNone;
+  };
   improving =
     ss->static_eval >= (ss - 2)->static_eval
     ||
@@ -966,12 +1192,12 @@ moves_loop:
     &&
     !excluded_move
     &&
-    (tte->bound() & kBoundLower)
+    (tt_data.bound() & kBoundLower)
     &&
-    tte->depth() >= depth - 3 * kOnePly;
+    tt_data.depth() >= depth - 3 * kOnePly;
 
   // Loop through moves
-  while ((move = mp.next_move()) != kMoveNone)
+  while ((move = next_move()) != kMoveNone)
   {
     assert(is_ok(move));
 
@@ -1107,17 +1333,44 @@ moves_loop:
         continue;
     }
 
+    // 合法性を調べている間に子局面の置換表と評価関数の表を読んでおく
+    Key child_board_key, child_hand_key;
+    pos.keys_after(move, &child_board_key, &child_hand_key);
+    const Key child_key = child_board_key + child_hand_key;
+    prefetch(TT.first_entry(child_board_key, child_hand_key));
+    Eval::prefetch_after(pos, move, child_key);
+
     if (!root_node && !pos.legal(move, ci.pinned))
     {
       ss->move_count = --move_count;
       continue;
     }
 
+    // ABDADA: 他のスレッドが探索中の子局面は、その結果が置換表に入るのを待って後で探索する
+    if
+    (
+      abdada
+      &&
+      !root_node
+      &&
+      move_count > 1
+      &&
+      !picker_done
+      &&
+      Busy.busy(child_key, this_thread->index_)
+    )
+    {
+      deferred_moves[deferred_count++] = move;
+      ss->move_count = --move_count;
+      continue;
+    }
+
     ss->current_move = move;
 
     // Make the move
     pos.do_move(move, st, gives_check);
-    (ss + 1)->evaluated = false;
+    assert(pos.key() == child_key);
+    const bool busy_marked = abdada && Busy.mark(child_key, this_thread->index_);
 
     // Reduced depth search (LMR)
     if
@@ -1239,6 +1492,8 @@ moves_loop:
 
     // Undo move
     pos.undo_move(move);
+    if (busy_marked)
+      Busy.unmark(child_key);
 
     assert(value > -kValueInfinite && value < kValueInfinite);
 
@@ -1341,7 +1596,7 @@ moves_loop:
     prev_cmh.update(prev_move_piece, prev_move_square, bonus);
   }
 
-  tte->save
+  tte.save
   (
     position_key,
     value_to_tt(best_value, ss->ply),
@@ -1381,7 +1636,9 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
 
   Move pv[kMaxPly + 1];
   StateInfo st;
-  TTEntry *tte;
+  TTSlot tte;
+  TTEntry *qs_entry;
+  TTEntry tt_data;
   Key position_key;
   Move tt_move;
   Move move;
@@ -1410,7 +1667,7 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
 
   Repetition repetition = ((ss - 1)->current_move != kMoveNull) ? pos.in_repetition() : kNoRepetition;
   if (repetition == kRepetition || ss->ply >= kMaxPly)
-    return ss->ply >= kMaxPly && !InCheck ? evaluate(pos, ss) : DrawValue[pos.side_to_move()];
+    return ss->ply >= kMaxPly && !InCheck ? evaluate(pos) : DrawValue[pos.side_to_move()];
 
   assert(0 <= ss->ply && ss->ply < kMaxPly);
 
@@ -1445,10 +1702,18 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
     kDepthQsNoChecks;
 
   // Transposition table lookup
-  position_key = pos.key();
-  tte = TT.probe(position_key, &tt_hit);
-  tt_move = tt_hit ? tte->move(pos) : kMoveNone;
-  tt_value = tt_hit ? value_from_tt(tte->value(),ss->ply) : kValueNone;
+  // 先にスレッドごとのqsearch用の表を引き、なければ共有の置換表を引く
+  Thread *this_thread = pos.this_thread();
+  position_key = TT.key(pos, false);
+  qs_entry = this_thread->qsearch_cache_.probe(position_key, &tt_hit, &tt_data, &this_thread->tt_stats_);
+  tte =
+    tt_hit
+    ?
+    TTSlot()
+    :
+    TT.probe(pos, position_key, &tt_hit, &tt_data, &this_thread->tt_stats_);
+  tt_move = tt_hit ? tt_data.move(pos) : kMoveNone;
+  tt_value = tt_hit ? value_from_tt(tt_data.value(),ss->ply) : kValueNone;
 
   if
   (
@@ -1456,16 +1721,16 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
     &&
     tt_hit
     &&
-    tte->depth() >= tt_depth
+    tt_data.depth() >= tt_depth
     &&
     tt_value != kValueNone
     &&
     (
       tt_value >= beta
       ?
-      (tte->bound() &  kBoundLower)
+      (tt_data.bound() &  kBoundLower)
       :
-      (tte->bound() &  kBoundUpper)
+      (tt_data.bound() &  kBoundUpper)
     )
   )
   {
@@ -1491,8 +1756,11 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
       mate_move != kMoveNone
     )
     {
-      tte->save
+      qsearch_save
       (
+        pos,
+        tte,
+        qs_entry,
         position_key,
         value_to_tt(mate_in(ss->ply + 1), ss->ply),
         kBoundExact,
@@ -1506,12 +1774,12 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
 
     if (tt_hit)
     {
-      if ((ss->static_eval = best_value = tte->eval_value()) == kValueNone)
-        ss->static_eval = best_value = evaluate(pos, ss);
+      if ((ss->static_eval = best_value = tt_data.eval_value()) == kValueNone)
+        ss->static_eval = best_value = evaluate(pos);
 
       if (tt_value != kValueNone)
       {
-        if (tte->bound() & (tt_value > best_value ? kBoundLower : kBoundUpper))
+        if (tt_data.bound() & (tt_value > best_value ? kBoundLower : kBoundUpper))
           best_value = tt_value;
       }
     }
@@ -1520,7 +1788,7 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
       ss->static_eval = best_value =
         (ss - 1)->current_move != kMoveNull
         ?
-        evaluate(pos, ss)
+        evaluate(pos)
         :
         -(ss - 1)->static_eval + 2 * Eval::kTempo;
     }
@@ -1529,9 +1797,12 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
     {
       if (!tt_hit)
       {
-        tte->save
+        qsearch_save
         (
-          pos.key(),
+          pos,
+          tte,
+          qs_entry,
+          position_key,
           value_to_tt(best_value, ss->ply),
           kBoundLower,
           kDepthNone,
@@ -1601,13 +1872,19 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
     )
       continue;
 
+    Key child_board_key, child_hand_key;
+    pos.keys_after(move, &child_board_key, &child_hand_key);
+    const Key child_key = child_board_key + child_hand_key;
+    prefetch(TT.first_entry(child_board_key, child_hand_key));
+    Eval::prefetch_after(pos, move, child_key);
+
     if (!pos.legal(move, ci.pinned))
       continue;
 
     ss->current_move = move;
 
     pos.do_move(move, st, gives_check);
-    (ss + 1)->evaluated = false;
+    assert(pos.key() == child_key);
 
     value =
       gives_check
@@ -1635,8 +1912,11 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
         }
         else
         {
-          tte->save
+          qsearch_save
           (
+            pos,
+            tte,
+            qs_entry,
             position_key,
             value_to_tt(value, ss->ply),
             kBoundLower,
@@ -1655,8 +1935,11 @@ qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta, Depth depth)
   if (InCheck && best_value == -kValueInfinite)
     return mated_in(ss->ply - 1);
 
-  tte->save
+  qsearch_save
   (
+    pos,
+    tte,
+    qs_entry,
     position_key,
     value_to_tt(best_value, ss->ply),
     (
@@ -1719,6 +2002,40 @@ value_from_tt(Value v, int ply)
     );
 }
 
+// qsearchの結果を保存する
+// スレッドごとの表には全部入れ、共有の置換表にはカットした値(下限)だけを入れる
+// qsearchの表を使わない(QsearchHashが0)ときは今までどおり共有の置換表に全部入れる
+void
+qsearch_save
+(
+  const Position &pos,
+  TTSlot tte,
+  TTEntry *qs_entry,
+  Key key,
+  Value v,
+  Bound b,
+  Depth d,
+  Move m,
+  Value ev,
+  uint8_t g
+)
+{
+  if (qs_entry != nullptr)
+    qs_entry->save(key, v, b, d, m, ev, g);
+
+  if (qs_entry == nullptr || (b & kBoundLower))
+  {
+    // qsearchの表で当たったときは共有の置換表を引いていない
+    if (!tte)
+    {
+      bool    found;
+      TTEntry data;
+      tte = TT.probe(pos, key, &found, &data);
+    }
+    tte.save(key, v, b, d, m, ev, g);
+  }
+}
+
 void
 update_pv(Move *pv, Move move, Move *child_pv)
 {
@@ -1753,9 +2070,12 @@ update_stats
   Square prev_own_square = move_to((ss - 2)->current_move);
   Piece  prev_piece  = move_piece((ss - 1)->current_move, ~pos.side_to_move());
   Piece  prev_own_piece = move_piece((ss - 2)->current_move, pos.side_to_move());
+  Thread *this_thread = pos.this_thread();
+#ifndef LEARN
+  CounterMoveHistoryStats &CounterMoveHistory = *this_thread->counter_move_history_;
+#endif
   CounterMoveStats &cmh = CounterMoveHistory[prev_piece][prev_square];
   CounterMoveStats &fmh = CounterMoveHistory[prev_own_piece][prev_own_square];
-  Thread *this_thread = pos.this_thread();
 
   this_thread->history_.update(move_piece(move, pos.side_to_move()), move_to(move), bonus);
 
@@ -1827,6 +2147,276 @@ check_time()
     Signals.stop = true;
 }
 
+void
+report_mate(Position &pos)
+{
+  std::vector<Move> pv;
+  const MateSolver::Result result =
+    Mate.solve(pos, Limits.nodes, Limits.infinite ? 0 : Limits.movetime, &pv);
+
+  if (result == MateSolver::kMate && !pv.empty())
+  {
+    sync_cout << "checkmate";
+    for (Move m : pv)
+      std::cout << " " << USI::format_move(m);
+    std::cout << sync_endl;
+  }
+  else if (result == MateSolver::kMate)
+  {
+    // 詰みは証明したが、表から手順を取り出せなかった
+    sync_cout << "checkmate notimplemented" << sync_endl;
+  }
+  else if (result == MateSolver::kNoMate)
+  {
+    sync_cout << "checkmate nomate" << sync_endl;
+  }
+  else
+  {
+    sync_cout << "checkmate timeout" << sync_endl;
+  }
+}
+
+// 詰み手順の各局面に詰みの値を置換表へ書く
+// 攻め方の局面は下限、玉方の局面は上限として、どの深さの探索でも使えるようにする
+// 値は探索と同じく、その局面から数えた手数にしてvalue_to_ttで書く
+// 詰みまでkMaxPly手以上ある局面は詰みの値で表せないので書かない
+void
+mate_thread_search(Position pos)
+{
+  std::vector<Move> pv;
+  if (Mate.solve(pos, 0, 0, &pv) != MateSolver::kMate || pv.empty())
+    return;
+
+  std::vector<StateInfo> states(pv.size());
+  const int length = static_cast<int>(pv.size());
+  for (int i = 0; i < length; ++i)
+  {
+    if (length - i < kMaxPly)
+    {
+      bool found;
+      TTEntry data;
+      const Key key = TT.key(pos, false);
+      TTSlot tte = TT.probe(pos, key, &found, &data);
+      const Value v = i % 2 == 0 ? mate_in(length - i) : mated_in(length - i);
+      if (tte)
+        tte.save
+        (
+          key,
+          value_to_tt(v, 0),
+          i % 2 == 0 ? kBoundLower : kBoundUpper,
+          Depth(kMaxPly - 1),
+          pv[i],
+          kValueNone,
+          TT.generation()
+        );
+    }
+    pos.do_move(pv[i], states[i]);
+  }
+  for (int i = length - 1; i >= 0; --i)
+    pos.undo_move(pv[i]);
+
+  sync_cout << "info string mate thread found mate in " << length
+    << " (" << Mate.nodes() << " nodes)" << sync_endl;
+}
+
+#ifndef LEARN
+// 行ごとの結果をまとめて、次の深さで配る順位を作る(Lines.mutexを取って呼ぶ)
+// 前の深さの順位で上の指し手を除いて探索するので、順位が入れ替わると同じ指し手が2つの行に出ることがある
+// そのときは上の行の結果を使い、抜けた行だけを、まとめた指し手を除いて同じ深さでもう一度配る
+void
+merge_lines()
+{
+  Search::RootMoveVector merged;
+  for (const RootMove &rm : Lines.results)
+  {
+    if (std::find(merged.begin(), merged.end(), rm.pv[0]) == merged.end())
+      merged.push_back(rm);
+  }
+  std::stable_sort(merged.begin(), merged.end());
+
+  const size_t fresh = merged.size();
+  for (const RootMove &rm : Lines.order)
+  {
+    if (std::find(merged.begin(), merged.end(), rm.pv[0]) == merged.end())
+      merged.push_back(rm);
+  }
+  Lines.order.swap(merged);
+
+  if (fresh < Lines.results.size())
+  {
+    std::copy(Lines.order.begin(), Lines.order.begin() + fresh, Lines.results.begin());
+    Lines.next = Lines.done = fresh;
+    Lines.cv.notify_all();
+    return;
+  }
+
+  Lines.best = Lines.order;
+  Lines.completed = Lines.depth;
+  Lines.depth += kOnePly;
+  Lines.next = 0;
+  Lines.done = 0;
+  Lines.cv.notify_all();
+}
+
+// まとめ終えた深さがあれば読み筋を表示して、止めるかどうかを決める
+// 最後の深さまでまとめ終えていればtrueを返す
+bool
+publish_lines(MainThread *th, Depth last_depth)
+{
+  {
+    std::lock_guard<std::mutex> lock(Lines.mutex);
+    if (Lines.completed <= th->completed_depth_)
+      return th->completed_depth_ >= last_depth;
+
+    th->root_moves_ = Lines.best;
+    th->completed_depth_ = Lines.completed;
+    th->pv_index_ = Lines.results.size() - 1;
+  }
+
+  sync_cout << usi_pv(th->root_pos_, th->completed_depth_, -kValueInfinite, kValueInfinite) << sync_endl;
+
+  const Value best_value = th->root_moves_[0].score;
+  if
+  (
+    Limits.mate
+    &&
+    best_value >= kValueMateInMaxPly
+    &&
+    kValueMate - best_value <= 2 * Limits.mate
+  )
+    Signals.stop = true;
+
+  if
+  (
+    Limits.use_time_management()
+    &&
+    !Signals.stop
+    &&
+    !Signals.stop_on_ponder_hit
+    &&
+    Time.elapsed() > Time.available_time()
+  )
+  {
+    if (Limits.ponder)
+      Signals.stop_on_ponder_hit = true;
+    else
+      Signals.stop = true;
+  }
+
+  return th->completed_depth_ >= last_depth;
+}
+
+// MultiPVSplitのときのThread::search
+// 配られた行を探索して返すことを、止められるか最後の深さまで繰り返す
+void
+search_lines(Thread *th, SearchStack *ss)
+{
+  MainThread *main_thread = (th == Threads.main() ? Threads.main() : nullptr);
+  const Depth last_depth = Limits.depth ? Depth(Limits.depth - 1) : Depth(kDepthMax - 1);
+
+  while (!Signals.stop)
+  {
+    if (main_thread && publish_lines(main_thread, last_depth))
+      break;
+
+    bool assigned = false;
+    {
+      std::unique_lock<std::mutex> lock(Lines.mutex);
+      if (!main_thread)
+        th->completed_depth_ = Lines.completed;
+
+      if (Lines.depth <= last_depth && Lines.next < Lines.results.size())
+      {
+        th->pv_index_ = Lines.next++;
+        th->root_depth_ = Lines.depth;
+        th->root_moves_ = Lines.order;
+        assigned = true;
+      }
+      else
+      {
+        // 配る行がなければ、他のスレッドがその深さを終えて行を配り直すまで眠る
+        // Signals.stopでは起こされないので、時々起きて確かめる
+        Lines.cv.wait_for(lock, std::chrono::milliseconds(5));
+      }
+    }
+
+    // 主スレッドは探索していないとcheck_time()が呼ばれないので、ここで時間を見る
+    if (!assigned)
+    {
+      if (main_thread)
+        check_time();
+      continue;
+    }
+
+    const size_t pv_index = th->pv_index_;
+    Value best_value;
+    Value alpha = -kValueInfinite;
+    Value beta = kValueInfinite;
+    Value delta = -kValueInfinite;
+
+    for (RootMove &rm : th->root_moves_)
+      rm.previous_score = rm.score;
+
+    if (th->root_depth_ >= 5 * kOnePly)
+    {
+      delta = Value(64);
+      alpha = std::max(th->root_moves_[pv_index].previous_score - delta, -kValueInfinite);
+      beta  = std::min(th->root_moves_[pv_index].previous_score + delta, kValueInfinite);
+    }
+
+    while (true)
+    {
+      best_value = ::search<kPV>(th->root_pos_, ss, alpha, beta, th->root_depth_, false);
+
+      std::stable_sort(th->root_moves_.begin() + pv_index, th->root_moves_.end());
+      th->root_moves_[pv_index].insert_pv_in_tt(th->root_pos_);
+
+      if (Signals.stop)
+        break;
+
+      if (best_value <= alpha)
+      {
+        beta = (alpha + beta) / 2;
+        alpha = std::max(best_value - delta, -kValueInfinite);
+      }
+      else if (best_value >= beta)
+      {
+        alpha = (alpha + beta) / 2;
+        beta = std::min(best_value + delta, kValueInfinite);
+      }
+      else
+      {
+        break;
+      }
+
+      delta += delta / 4 + 5;
+      assert(alpha >= -kValueInfinite && beta <= kValueInfinite);
+    }
+
+    // 途中で止められた行は返さない
+    if (Signals.stop)
+      break;
+
+    std::lock_guard<std::mutex> lock(Lines.mutex);
+    if (th->root_depth_ == Lines.depth)
+    {
+      Lines.results[pv_index] = th->root_moves_[pv_index];
+      if (++Lines.done == Lines.results.size())
+        merge_lines();
+    }
+  }
+
+  // bestmoveは最後にまとめた深さの順位から選ぶ(どのスレッドも同じ結果を持つ)
+  std::lock_guard<std::mutex> lock(Lines.mutex);
+  if (Lines.completed > kDepthZero)
+  {
+    th->root_moves_ = Lines.best;
+    th->completed_depth_ = Lines.completed;
+    th->pv_index_ = Lines.results.size() - 1;
+  }
+}
+#endif
+
 } // namespace
 
 string
@@ -1863,10 +2453,8 @@ usi_pv(const Position &pos, Depth depth, Value alpha, Value beta)
 
     ss << " nodes " << nodes_searched
        << " nps " << nodes_searched * 1000 / elapsed;
-#if 0
     if (elapsed > 1000) // Earlier makes little sense
       ss << " hashfull " << TT.hashfull();
-#endif
     ss << " time "      << elapsed
        << " pv";
 
@@ -1882,16 +2470,18 @@ RootMove::insert_pv_in_tt(Position& pos)
 {
   StateInfo state[kMaxPly];
   StateInfo *st = state;
-  TTEntry *tte;
+  TTSlot tte;
+  TTEntry tt_data;
   bool tt_hit;
 
   size_t idx;
   for (idx = 0; idx < pv.size(); ++idx)
   {
-    tte = TT.probe(pos.key(), &tt_hit);
+    const Key key = TT.key(pos, false);
+    tte = TT.probe(pos, key, &tt_hit, &tt_data);
 
-    if (!tt_hit || tte->move(pos) != pv[idx])
-      tte->save(pos.key(), kValueNone, kBoundNone, kDepthNone, pv[idx], kValueNone, TT.generation());
+    if (!tt_hit || tt_data.move(pos) != pv[idx])
+      tte.save(key, kValueNone, kBoundNone, kDepthNone, pv[idx], kValueNone, TT.generation());
 
     assert(MoveList<kLegal>(pos).contains(pv[idx]));
 
@@ -1912,10 +2502,11 @@ RootMove::extract_ponder_from_tt(Position &pos)
   assert(pv.size() == 1);
 
   pos.do_move(pv[0], st);
-  TTEntry *tte = TT.probe(pos.key(), &found);
+  TTEntry tt_data;
+  TT.probe(pos, TT.key(pos, false), &found, &tt_data);
   if (found)
   {
-    Move m = tte->move(pos);
+    Move m = tt_data.move(pos);
     if (MoveList<kLegal>(pos).contains(m))
     {
       pv.push_back(m);
@@ -43,11 +43,6 @@ struct SearchStack
   Move   excluded_move;
   Move   killers[2];
   Value  static_eval;
-  Value  black_kpp;
-  Value  white_kpp;
-  Value  kkp;
-  Value  material;
-  bool   evaluated;
   bool   skip_early_pruning;
   int    move_count;
 };
@@ -96,6 +91,7 @@ struct LimitsType
     depth = 0;
     movetime = 0;
     mate = 0;
+    solve_mate = false;
     infinite = 0;
     ponder = 0;
     byoyomi = 0;
@@ -115,6 +111,7 @@ struct LimitsType
   int64_t nodes;
   int movetime;
   int mate;
+  bool solve_mate;    // go mateで詰みだけを調べる
   int infinite;
   int ponder;
   int byoyomi;
@@ -37,6 +37,11 @@ Thread::Thread()
 {
   reset_calls_ = false;
   exit_        = false;
+  eval_hash_probes_ = 0;
+  eval_hash_hits_   = 0;
+  tt_stats_.clear();
+  qsearch_cache_.resize(Options["QsearchHash"]);
+  kpp_cache_.clear();
   history_.clear();
   counter_moves_.clear();
   index_  = Threads.size();
@@ -53,6 +58,9 @@ Thread::~Thread()
   sleep_condition_.notify_one();
   mutex_.unlock();
   native_thread_.join();
+#ifndef LEARN
+  delete counter_move_history_;
+#endif
 }
 
 void
@@ -84,6 +92,12 @@ Thread::start_searching(bool resume)
 void
 Thread::idle_loop()
 {
+#ifndef LEARN
+  // コンストラクタはこれが終わるまで待つ
+  counter_move_history_ = new CounterMoveHistoryStats;
+  counter_move_history_->clear();
+#endif
+
   while (!exit_)
   {
     std::unique_lock<std::mutex> lk(mutex_);
@@ -144,6 +158,34 @@ ThreadPool::nodes_searched()
   return nodes;
 }
 
+uint64_t
+ThreadPool::eval_hash_probes()
+{
+  uint64_t probes = 0;
+  for (Thread *th : *this)
+    probes += th->eval_hash_probes_;
+  return probes;
+}
+
+uint64_t
+ThreadPool::eval_hash_hits()
+{
+  uint64_t hits = 0;
+  for (Thread *th : *this)
+    hits += th->eval_hash_hits_;
+  return hits;
+}
+
+TTStats
+ThreadPool::tt_stats()
+{
+  TTStats stats;
+  stats.clear();
+  for (Thread *th : *this)
+    stats += th->tt_stats_;
+  return stats;
+}
+
 void
 ThreadPool::start_thinking
 (
@@ -159,6 +201,11 @@ ThreadPool::start_thinking
 
   main()->root_moves_.clear();
   main()->root_pos_ = pos;
+  for (Thread *th : *this)
+  {
+    th->eval_hash_probes_ = th->eval_hash_hits_ = 0;
+    th->tt_stats_.clear();
+  }
   Limits = limits;
   if (states.get())
   {
@@ -31,9 +31,11 @@
 #include <thread>
 #include <vector>
 
+#include "evaluate.h"
 #include "move_picker.h"
 #include "position.h"
 #include "search.h"
+#include "transposition_table.h"
 
 class Thread
 {
@@ -76,6 +78,17 @@ public:
   MovesStats             counter_moves_;
   Depth                  completed_depth_;
   std::atomic_bool       reset_calls_;
+  uint64_t               eval_hash_probes_;
+  uint64_t               eval_hash_hits_;
+  TTStats                tt_stats_;
+  QsearchCache           qsearch_cache_;
+  MateCache              mate_cache_;
+#ifndef LEARN
+  // 全スレッドで共有するとキャッシュラインの取り合いになるので、スレッドごとに持つ
+  // 自分のNUMAノードに置くように、探索スレッドが確保して最初に触る
+  CounterMoveHistoryStats *counter_move_history_;
+#endif
+  Eval::KppCache         kpp_cache_;
 };
 
 struct MainThread : public Thread
@@ -110,6 +123,15 @@ struct ThreadPool : public std::vector<Thread *>
 
   int64_t
   nodes_searched();
+
+  uint64_t
+  eval_hash_probes();
+
+  uint64_t
+  eval_hash_hits();
+
+  TTStats
+  tt_stats();
 };
 
 extern ThreadPool Threads;
@@ -21,25 +21,393 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
 
+#if !defined(_MSC_VER)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
 #include "transposition_table.h"
+#include "usi.h"
 
 TranspositionTable TT;
 
+namespace
+{
+// tt saveで書き出すファイルの先頭
+// 表はmmapできるようにkTTFileAlignから置く
+struct TTFileHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t entry_size;     // sizeof(TTEntry)
+  uint32_t cluster_size;   // 1クラスタのエントリ数
+  uint32_t generation;
+  uint64_t cluster_count;
+  uint32_t hand_superiority; // keyの作り方(TranspositionTable::key())
+};
+
+const char kTTFileMagic[8] = { 'N', 'Z', 'M', 'T', 'T', '\0', '\0', '\0' };
+constexpr uint32_t kTTFileVersion = 1;
+constexpr size_t   kTTFileAlign   = 4096;
+
+// 共有メモリに置く置換表の先頭
+// ファイルと同じヘッダの後に、プロセス間で使う世代とつないでいるプロセスのpidを置く
+// 作ったプロセスがheaderを書き終えてからreadyを1にする
+constexpr int kSharedTTMaxProcesses = 64;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared TT needs lock-free atomics");
+
+} // namespace
+
+struct SharedTTHeader
+{
+  TTFileHeader          header;
+  std::atomic<uint32_t> ready;
+  std::atomic<uint32_t> generation;
+  std::atomic<int32_t>  pids[kSharedTTMaxProcesses];
+};
+
+namespace
+{
+static_assert(sizeof(SharedTTHeader) <= kTTFileAlign, "SharedTTHeader must fit in the first page");
+
+#if !defined(_MSC_VER)
+// pidのプロセスが生きているか(他のユーザのプロセスならEPERMになる)
+bool
+is_alive(int32_t pid)
+{
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+#endif
+
+// 読み込んだヘッダがこのビルドの置換表と同じ形か調べる
+const char *
+check_header(const TTFileHeader &header, uint64_t file_size, size_t entry_size, size_t cluster_size, size_t cluster_bytes)
+{
+  if (std::memcmp(header.magic, kTTFileMagic, sizeof(kTTFileMagic)) != 0)
+    return "not a hash file";
+  if (header.version != kTTFileVersion)
+    return "unsupported version";
+  if (header.entry_size != entry_size || header.cluster_size != cluster_size)
+    return "different entry or cluster geometry (TTGeometry)";
+  if (header.cluster_count == 0 || file_size != kTTFileAlign + header.cluster_count * cluster_bytes)
+    return "size mismatch";
+  return nullptr;
+}
+
+#if !defined(_MSC_VER)
+// オンラインのNUMAノードのビットマスク
+uint64_t
+numa_node_mask()
+{
+  uint64_t mask = 0;
+  for (int node = 0; node < 64; ++node)
+  {
+    const std::string path = "/sys/devices/system/node/node" + std::to_string(node);
+    if (access(path.c_str(), F_OK) == 0)
+      mask |= 1ULL << node;
+  }
+  return mask;
+}
+#endif
+} // namespace
+
+// 大きな置換表を4KBのページで確保するとprobeのたびにTLBミスが起きるので、
+// 2MBのラージページ(MAP_HUGETLB)を試し、だめならTHPに任せる
+// 複数のNUMAノードがあれば、最初に触ったスレッドのノードに偏らないようにページを交互に置く
+void
+TranspositionTable::allocate(size_t size)
+{
+#if defined(_MSC_VER)
+  mem_size_  = size + kCacheLineSize - 1;
+  mem_       = calloc(mem_size_, 1);
+  table_     = (char*)((uintptr_t(mem_) + kCacheLineSize - 1) & ~(kCacheLineSize - 1));
+  page_mode_ = "normal pages";
+  numa_mode_ = "default";
+#else
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+  const size_t huge_size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  p = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED)
+  {
+    mem_size_  = huge_size;
+    page_mode_ = "huge pages (hugetlb)";
+  }
+#endif
+  if (p == MAP_FAILED)
+  {
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+      mem_   = nullptr;
+      table_ = nullptr;
+      return;
+    }
+    mem_size_  = size;
+    page_mode_ = "normal pages";
+#ifdef MADV_HUGEPAGE
+    if (madvise(p, size, MADV_HUGEPAGE) == 0)
+      page_mode_ = "transparent huge pages";
+#endif
+  }
+  mem_   = p;
+  table_ = static_cast<char *>(p);
+
+  // まだどのページにも触っていないので、ここで方針を決めれば割り当てに反映される
+  const uint64_t nodes = numa_node_mask();
+  const int node_count = __builtin_popcountll(nodes);
+  numa_mode_ = "single node";
+#ifdef SYS_mbind
+  if (node_count > 1)
+  {
+    constexpr int kMpolInterleave = 3;
+    numa_mode_ =
+      syscall(SYS_mbind, p, mem_size_, kMpolInterleave, &nodes, 64, 0) == 0
+      ?
+      "interleave " + std::to_string(node_count) + " nodes"
+      :
+      "first touch (mbind failed)";
+  }
+#endif
+#endif
+}
+
+// 共有メモリは名前でつなぐので、同じ名前を指定したプロセスは同じ表を読み書きする
+// 表の大きさと形は最初に作ったプロセスのものになる
+bool
+TranspositionTable::attach_shared(size_t size)
+{
+#if defined(_MSC_VER)
+  (void)size;
+  sync_cout << "info string hash shared memory is not supported on this platform" << sync_endl;
+  return false;
+#else
+  const std::string &name = shared_name_;
+  auto fail = [&](const char *reason, int fd)
+  {
+    if (fd >= 0)
+      close(fd);
+    sync_cout << "info string hash shared " << name << " failed: " << reason
+              << ", using private memory" << sync_endl;
+    return false;
+  };
+
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  const bool creator = fd >= 0;
+  if (!creator)
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+  if (fd < 0)
+    return fail(std::strerror(errno), fd);
+
+  size_t segment_size = kTTFileAlign + size;
+  if (creator)
+  {
+    if (ftruncate(fd, static_cast<off_t>(segment_size)) != 0)
+    {
+      shm_unlink(name.c_str());
+      return fail(std::strerror(errno), fd);
+    }
+  }
+  else
+  {
+    // 作ったプロセスがまだ大きさを決めていなければ少し待つ
+    struct stat st;
+    for (int i = 0; i < 100 && fstat(fd, &st) == 0 && st.st_size < static_cast<off_t>(kTTFileAlign); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kTTFileAlign))
+      return fail("segment has no header", fd);
+    segment_size = static_cast<size_t>(st.st_size);
+  }
+
+  void *p = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+  {
+    if (creator)
+      shm_unlink(name.c_str());
+    return fail(std::strerror(errno), -1);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(p, segment_size, MADV_HUGEPAGE);
+#endif
+
+  SharedTTHeader *shared = static_cast<SharedTTHeader *>(p);
+  if (creator)
+  {
+    TTFileHeader &header = shared->header;
+    std::memcpy(header.magic, kTTFileMagic, sizeof(kTTFileMagic));
+    header.version          = kTTFileVersion;
+    header.entry_size       = entry_bytes();
+    header.cluster_size     = cluster_size();
+    header.generation       = generation_;
+    header.cluster_count    = size / cluster_bytes_;
+    header.hand_superiority = hand_superiority_;
+    shared->generation.store(generation_);
+    shared->ready.store(1, std::memory_order_release);
+  }
+  else
+  {
+    for (int i = 0; i < 100 && shared->ready.load(std::memory_order_acquire) == 0; ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    const char *error =
+      shared->ready.load(std::memory_order_acquire) == 0
+      ?
+      "segment was never initialized"
+      :
+      (shared->header.hand_superiority != 0) != hand_superiority_
+      ?
+      "different key mode (TTHandSuperiority)"
+      :
+      check_header(shared->header, segment_size, entry_bytes(), cluster_size(), cluster_bytes_);
+    if (error)
+    {
+      munmap(p, segment_size);
+      return fail(error, -1);
+    }
+  }
+
+  // 空いているか、持ち主の死んだ場所に自分のpidを書く
+  const int32_t pid = static_cast<int32_t>(getpid());
+  shared_slot_ = -1;
+  for (int i = 0; i < kSharedTTMaxProcesses && shared_slot_ < 0; ++i)
+  {
+    int32_t owner = shared->pids[i].load();
+    if ((owner == 0 || !is_alive(owner)) && shared->pids[i].compare_exchange_strong(owner, pid))
+      shared_slot_ = i;
+  }
+
+  shared_        = shared;
+  mem_           = p;
+  mem_size_      = segment_size;
+  table_         = static_cast<char *>(p) + kTTFileAlign;
+  cluster_count_ = shared->header.cluster_count;
+  generation_    = static_cast<uint8_t>(shared->generation.load());
+  page_mode_     = creator ? "shared memory (created)" : "shared memory (joined)";
+  numa_mode_     = "default";
+  return true;
+#endif
+}
+
+std::string
+TranspositionTable::description() const
+{
+  std::ostringstream ss;
+  ss << cluster_count_ * cluster_bytes_ / (1024 * 1024) << "MB "
+     << geometry_name(geometry_) << ", " << allocation();
+  if (shared_)
+    ss << " " << shared_name_ << " (" << shared_users() << " processes)";
+  return ss.str();
+}
+
+int
+TranspositionTable::shared_users() const
+{
+  int count = 0;
+#if !defined(_MSC_VER)
+  for (int i = 0; i < kSharedTTMaxProcesses; ++i)
+  {
+    if (is_alive(shared_->pids[i].load()))
+      ++count;
+  }
+#endif
+  return count;
+}
+
+uint8_t
+TranspositionTable::shared_new_search()
+{
+  return static_cast<uint8_t>(shared_->generation.fetch_add(4) + 4);
+}
+
+void
+TranspositionTable::set_shared(const std::string &name)
+{
+  const std::string new_name =
+    name == "<empty>" || name.empty()
+    ?
+    ""
+    :
+    (name[0] == '/' ? name : "/" + name);
+  if (new_name == shared_name_)
+    return;
+
+  // 名前を変える前に、今つないでいる共有メモリを古い名前で手放す
+  release();
+  shared_name_ = new_name;
+  if (mb_size_ == 0)
+    return;
+
+  cluster_count_ = 0;
+  resize(mb_size_);
+}
+
+void
+TranspositionTable::release()
+{
+  if (!mem_)
+    return;
+#if defined(_MSC_VER)
+  free(mem_);
+#else
+  // 最後に使っていたプロセスが名前を消す
+  if (shared_)
+  {
+    if (shared_slot_ >= 0)
+      shared_->pids[shared_slot_].store(0);
+    const bool last = shared_users() == 0;
+    shared_      = nullptr;
+    shared_slot_ = -1;
+    munmap(mem_, mem_size_);
+    if (last)
+      shm_unlink(shared_name_.c_str());
+  }
+  else
+    munmap(mem_, mem_size_);
+#endif
+  mem_   = nullptr;
+  table_ = nullptr;
+}
+
 void 
 TranspositionTable::resize(uint64_t mb_size)
 {
-  size_t new_cluster_count = size_t(1) << msb((mb_size * 1024 * 1024) / sizeof(Cluster));
+  // 2のべき乗に丸めず、指定された大きさを全部使う
+  size_t new_cluster_count = (mb_size * 1024 * 1024) / cluster_bytes_;
 
+  mb_size_ = mb_size;
   if (new_cluster_count == cluster_count_)
     return;
 
   cluster_count_ = new_cluster_count;
 
-  free(mem_);
-  mem_ = calloc(cluster_count_ * sizeof(Cluster) + kCacheLineSize - 1, 1);
+  release();
+  if (shared_name_.empty() || !attach_shared(cluster_count_ * cluster_bytes_))
+  {
+    cluster_count_ = new_cluster_count;
+    allocate(cluster_count_ * cluster_bytes_);
+  }
 
   if (!mem_)
   {
@@ -48,50 +416,520 @@ TranspositionTable::resize(uint64_t mb_size)
     exit(EXIT_FAILURE);
   }
 
-  table_ = (Cluster*)((uintptr_t(mem_) + kCacheLineSize - 1) & ~(kCacheLineSize - 1));
+  // 確保したばかりのページをここで探索スレッドから触っておく
+  clear();
 }
 
+// 大きな表を1スレッドでmemsetすると対局の間に数秒止まるので、
+// 探索スレッドの数だけスレッドを立てて表を等分して0にする
+// 確保直後であれば、各ページは触ったスレッドの動いているNUMAノードに置かれる
 void 
-TranspositionTable::clear()
+TranspositionTable::clear(bool force)
 {
-  std::memset(table_, 0, cluster_count_ * sizeof(Cluster));
+  // 他のプロセスが探索中の表を消さない
+  // 世代は共有しているので、古いエントリは置き換えで自然に追い出される
+  if (shared_ && !force)
+  {
+    const int users = shared_users();
+    if (users > 1)
+    {
+      sync_cout << "info string hash shared with " << users << " processes, not cleared" << sync_endl;
+      return;
+    }
+  }
+
+  const TimePoint start      = now();
+  const size_t    thread_num = std::max<size_t>(Threads.size(), 1);
+
+  auto clear_slice = [this, thread_num](size_t i)
+  {
+    const size_t begin = cluster_count_ * i / thread_num;
+    const size_t end   = cluster_count_ * (i + 1) / thread_num;
+    std::memset(table_ + begin * cluster_bytes_, 0, (end - begin) * cluster_bytes_);
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_num; ++i)
+    threads.emplace_back(clear_slice, i);
+  clear_slice(0);
+  for (auto &t : threads)
+    t.join();
+
+  if (verbose_)
+    sync_cout << "info string hash clear " << now() - start << "ms ("
+              << thread_num << " threads)" << sync_endl;
 }
 
-TTEntry * 
-TranspositionTable::probe(const Key key, bool *found) const 
+template <typename Cluster>
+TTSlot 
+TranspositionTable::probe(const Key key, bool *found, TTEntry *data, TTStats *stats) const 
 {
-  TTEntry * const tte = first_entry(key);
-  const uint32_t key32 = key >> 32;
+  Cluster * const cluster = static_cast<Cluster *>(first_entry(key));
 
-  for (unsigned i = 0; i < kClusterSize; ++i)
+  for (int i = 0; i < Cluster::kSize; ++i)
   {
-    if (tte[i].key32_ == 0 || tte[i].key32_ == key32)
+    auto * const tte = &cluster->entry[i];
+
+    if (tte->is_empty())
+    {
+      if (stats)
+      {
+        ++stats->probes;
+        ++stats->empty;
+      }
+      data->data_ = data->key_ = 0;
+      *found = false;
+      return TTSlot(tte);
+    }
+
+    uint64_t entry_data;
+    if (tte->read(key, &entry_data))
     {
-      if
-      (
-        (tte[i].generation_and_bound8_ & 0xFC) != generation_
-        &&
-        tte[i].key32_ != 0
-      )
-        tte[i].generation_and_bound8_ = static_cast<uint8_t>(generation_ | tte[i].bound()); // Refresh
-      
-      *found = (tte[i].key32_ != 0);
-      return &tte[i];
+      if (stats)
+      {
+        ++stats->probes;
+        ++stats->hits;
+      }
+
+      data->store(key, entry_data);
+      if (data->generation() != generation_)
+      {
+        // Refresh
+        data->store(key, (entry_data & ~(0xFFULL << 48)) | static_cast<uint64_t>(generation_ | data->bound()) << 48);
+        tte->store(key, data->data_);
+      }
+
+      *found = true;
+      return TTSlot(tte);
     }
   }
 
-  TTEntry *replace = tte;
-  for (unsigned i = 1; i < kClusterSize; ++i)
+  if (stats)
   {
-    if
-    (
-      replace->depth8_ - ((259 + generation_ - replace->generation_and_bound8_) & 0xFC) * 2 * kOnePly
-      >
-      tte[i].depth8_   - ((259 + generation_ - tte[i].generation_and_bound8_)   & 0xFC) * 2 * kOnePly
-    )
-      replace = &tte[i];
+    ++stats->probes;
+    ++stats->replaced;
   }
+  data->data_ = data->key_ = 0;
   *found = false;
+  return TTSlot(replace_entry(cluster));
+}
+
+template <typename Cluster>
+typename Cluster::EntryType *
+TranspositionTable::replace_entry(Cluster *cluster) const
+{
+  auto *replace = &cluster->entry[0];
+  int replace_score = replace->depth() - ((259 + generation_ - replace->generation_and_bound8()) & 0xFC) * 2 * kOnePly;
+  for (int i = 1; i < Cluster::kSize; ++i)
+  {
+    const auto &tte   = cluster->entry[i];
+    const int   score = tte.depth() - ((259 + generation_ - tte.generation_and_bound8()) & 0xFC) * 2 * kOnePly;
+    if (replace_score > score)
+    {
+      replace       = &cluster->entry[i];
+      replace_score = score;
+    }
+  }
   return replace;
 }
 
+// ヘッダのprobe()から呼ぶ形
+template TTSlot TranspositionTable::probe<TTCluster3x10>(const Key, bool *, TTEntry *, TTStats *) const;
+template TTSlot TranspositionTable::probe<TTCluster5x12>(const Key, bool *, TTEntry *, TTStats *) const;
+template TTSlot TranspositionTable::probe<TTCluster4x16>(const Key, bool *, TTEntry *, TTStats *) const;
+
+// 持ち駒の優越を使うprobe
+// 同じ盤面で手番側の持ち駒が同じか多い局面の評価値は、その局面の評価値以上になる
+// 持ち駒が同じか多いエントリの上限と、同じか少ないエントリの下限は現局面でも使えるので、
+// 同じ局面のエントリがなければ、使える方の境界だけを残したものを*dataに入れて見つかったことにする
+// 静的評価値は局面ごとに違うので使わない
+// 返す書き込み先は現局面用の空きエントリか置き換えるエントリで、他の局面のエントリは上書きしない
+TTSlot 
+TranspositionTable::probe_hand(const Key board_key, const Key key, bool *found, TTEntry *data, TTStats *stats) const 
+{
+  constexpr Key kHandMask = (Key(1) << kHandBits) - 1;
+  TTCluster4x16 * const cluster = static_cast<TTCluster4x16 *>(first_entry(board_key));
+  TTEntry * const tte   = cluster->entry;
+  const Hand      hand  = static_cast<Hand>(key & kHandMask);
+  TTEntry        *empty = nullptr;
+  bool            dominated = false;
+
+  for (int i = 0; i < TTCluster4x16::kSize; ++i)
+  {
+    TTEntry entry;
+    entry.data_ = tte[i].data_;
+    entry.key_  = tte[i].key_;
+    const Key stored_key = entry.key_ ^ entry.data_;
+
+    if (stored_key == key)
+    {
+      if (stats)
+      {
+        ++stats->probes;
+        ++stats->hits;
+      }
+
+      if (entry.generation() != generation_)
+      {
+        // Refresh
+        entry.data_ = (entry.data_ & ~(0xFFULL << 48)) | static_cast<uint64_t>(generation_ | entry.bound()) << 48;
+        entry.key_  = key ^ entry.data_;
+        tte[i].data_ = entry.data_;
+        tte[i].key_  = entry.key_;
+      }
+
+      *data  = entry;
+      *found = true;
+      return TTSlot(&tte[i]);
+    }
+
+    if (stored_key == 0)
+    {
+      if (!empty)
+        empty = &tte[i];
+      continue;
+    }
+
+    if (dominated || (stored_key >> kHandBits) != (key >> kHandBits))
+      continue;
+
+    const Hand stored_hand = static_cast<Hand>(stored_key & kHandMask);
+    const int  usable =
+      is_hand_equal_or_win(stored_hand, hand)
+      ?
+      kBoundLower
+      :
+      is_hand_equal_or_win(hand, stored_hand)
+      ?
+      kBoundUpper
+      :
+      kBoundNone;
+    const int bound = entry.bound() & usable;
+    if (bound == kBoundNone)
+      continue;
+
+    // 指し手は持ち駒の違う局面のものなので、この局面では指せないかもしれない
+    // 値と境界だけを使い、指し手は返さない(singular extensionや指し手の並べ替えに使わせない)
+    const uint8_t generation_and_bound8 = static_cast<uint8_t>(entry.generation() | bound);
+    data->data_ = TTEntry::pack(0, entry.value(), kValueNone, generation_and_bound8, entry.depth());
+    data->key_  = key ^ data->data_;
+    dominated = true;
+  }
+
+  if (stats)
+  {
+    ++stats->probes;
+    if (dominated)
+      ++stats->hand_hits;
+    if (empty)
+      ++stats->empty;
+    else
+      ++stats->replaced;
+  }
+  if (!dominated)
+    data->data_ = data->key_ = 0;
+  *found = dominated;
+  return TTSlot(empty ? empty : replace_entry(cluster));
+}
+
+bool
+TranspositionTable::save(const std::string &path) const
+{
+  // 読み込み元(mmap中かもしれない)に上書きしないように、別名で書いてから置き換える
+  const std::string tmp = path + ".tmp";
+  std::ofstream ofs(tmp, std::ios::out | std::ios::binary);
+  if (!ofs)
+    return false;
+
+  TTFileHeader header = {};
+  std::memcpy(header.magic, kTTFileMagic, sizeof(kTTFileMagic));
+  header.version       = kTTFileVersion;
+  header.entry_size    = entry_bytes();
+  header.cluster_size  = cluster_size();
+  header.generation    = generation_;
+  header.cluster_count = cluster_count_;
+  header.hand_superiority = hand_superiority_;
+
+  std::vector<char> first_page(kTTFileAlign, 0);
+  std::memcpy(first_page.data(), &header, sizeof(header));
+  ofs.write(first_page.data(), first_page.size());
+  ofs.write(table_, cluster_count_ * cluster_bytes_);
+  ofs.close();
+  if (!ofs)
+  {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool
+TranspositionTable::load(const std::string &path, bool map)
+{
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  TTFileHeader header = {};
+  ifs.read(reinterpret_cast<char *>(&header), sizeof(header));
+  ifs.seekg(0, std::ios::end);
+  const uint64_t file_size = static_cast<uint64_t>(ifs.tellg());
+  ifs.close();
+
+  const char *error =
+    !ifs
+    ?
+    "cannot read file"
+    :
+    (header.hand_superiority != 0) != hand_superiority_
+    ?
+    "different key mode (TTHandSuperiority)"
+    :
+    check_header(header, file_size, entry_bytes(), cluster_size(), cluster_bytes_);
+  if (error)
+  {
+    sync_cout << "info string tt load failed: " << error << sync_endl;
+    return false;
+  }
+
+  const TimePoint start = now();
+  release();
+  cluster_count_ = header.cluster_count;
+  generation_    = static_cast<uint8_t>(header.generation);
+  const size_t table_size = cluster_count_ * cluster_bytes_;
+
+#if !defined(_MSC_VER)
+  if (map)
+  {
+    const int fd = open(path.c_str(), O_RDONLY);
+    void *p = fd < 0 ? MAP_FAILED : mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (fd >= 0)
+      close(fd);
+    if (p != MAP_FAILED)
+    {
+      madvise(p, file_size, MADV_WILLNEED);
+      mem_       = p;
+      mem_size_  = file_size;
+      table_     = static_cast<char *>(p) + kTTFileAlign;
+      page_mode_ = "file mapping";
+      numa_mode_ = "default";
+      sync_cout << "info string tt load " << path << " mapped "
+                << table_size / (1024 * 1024) << "MB" << sync_endl;
+      return true;
+    }
+  }
+#else
+  (void)map;
+#endif
+
+  allocate(table_size);
+  if (!mem_)
+  {
+    std::cerr << "Failed to allocate " << table_size / (1024 * 1024)
+              << "MB for transposition table." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // clear()と同じように探索スレッドの数に分けて読み、ページにも各スレッドから触る
+  const size_t thread_num = std::max<size_t>(Threads.size(), 1);
+  std::atomic<bool> ok(true);
+  auto read_slice = [&](size_t i)
+  {
+    const size_t begin = cluster_count_ * i / thread_num;
+    const size_t end   = cluster_count_ * (i + 1) / thread_num;
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(kTTFileAlign + begin * cluster_bytes_));
+    in.read(table_ + begin * cluster_bytes_, (end - begin) * cluster_bytes_);
+    if (!in)
+      ok = false;
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_num; ++i)
+    threads.emplace_back(read_slice, i);
+  read_slice(0);
+  for (auto &t : threads)
+    t.join();
+
+  if (!ok)
+  {
+    sync_cout << "info string tt load failed: read error" << sync_endl;
+    clear();
+    return false;
+  }
+
+  sync_cout << "info string tt load " << path << " "
+            << table_size / (1024 * 1024) << "MB " << now() - start << "ms" << sync_endl;
+  return true;
+}
+
+void
+QsearchCache::resize(size_t kb_size)
+{
+  const size_t count = kb_size * 1024 / sizeof(TTEntry);
+  if (count != entries_.size())
+    std::vector<TTEntry>(count).swap(entries_);
+  clear();
+}
+
+void
+QsearchCache::clear()
+{
+  if (!entries_.empty())
+    std::memset(entries_.data(), 0, entries_.size() * sizeof(TTEntry));
+}
+
+int
+TranspositionTable::hashfull() const
+{
+  // 先頭の1000エントリ前後を見る
+  const size_t sample = 1000 / cluster_size();
+  uint64_t used = 0;
+  uint64_t age[4] = {};
+  uint64_t bound[4] = {};
+  census(sample, 1, &used, age, bound);
+  return static_cast<int>(age[0] * 1000 / (sample * cluster_size()));
+}
+
+template <typename Cluster>
+void
+TranspositionTable::census(size_t sample, size_t step, uint64_t *used, uint64_t age[4], uint64_t bound[4]) const
+{
+  for (size_t i = 0; i < sample; ++i)
+  {
+    const Cluster *cluster = reinterpret_cast<const Cluster *>(table_ + i * step * cluster_bytes_);
+    for (int j = 0; j < Cluster::kSize; ++j)
+    {
+      const auto &tte = cluster->entry[j];
+      if (tte.is_empty())
+        continue;
+      ++*used;
+      ++age[std::min(((generation_ - (tte.generation_and_bound8() & 0xFC)) & 0xFC) >> 2, 3)];
+      ++bound[tte.generation_and_bound8() & 0x3];
+    }
+  }
+}
+
+void
+TranspositionTable::census(size_t sample, size_t step, uint64_t *used, uint64_t age[4], uint64_t bound[4]) const
+{
+  switch (geometry_)
+  {
+  case kTTGeometry3x10:
+    census<TTCluster3x10>(sample, step, used, age, bound);
+    break;
+
+  case kTTGeometry5x12:
+    census<TTCluster5x12>(sample, step, used, age, bound);
+    break;
+
+  default:
+    census<TTCluster4x16>(sample, step, used, age, bound);
+    break;
+  }
+}
+
+const char *
+TranspositionTable::geometry_name(TTGeometry geometry)
+{
+  static const char *const kNames[kNumberOfTTGeometry] = { "3x10", "5x12", "4x16" };
+  return kNames[geometry];
+}
+
+int
+TranspositionTable::cluster_size() const
+{
+  return
+    geometry_ == kTTGeometry3x10
+    ?
+    TTCluster3x10::kSize
+    :
+    geometry_ == kTTGeometry5x12
+    ?
+    TTCluster5x12::kSize
+    :
+    TTCluster4x16::kSize;
+}
+
+int
+TranspositionTable::key_bits() const
+{
+  return
+    geometry_ == kTTGeometry3x10
+    ?
+    16
+    :
+    geometry_ == kTTGeometry5x12
+    ?
+    32
+    :
+    64;
+}
+
+// 形を変えると同じ大きさでもクラスタ数とエントリの並びが変わるので、確保し直して空にする
+void
+TranspositionTable::set_layout(TTGeometry geometry, bool hand_superiority)
+{
+  requested_geometry_ = geometry;
+  hand_superiority_   = hand_superiority;
+
+  const TTGeometry effective = hand_superiority ? kTTGeometry4x16 : geometry;
+  if (effective == geometry_)
+  {
+    clear();
+    return;
+  }
+
+  geometry_      = effective;
+  cluster_bytes_ = effective == kTTGeometry3x10 ? sizeof(TTCluster3x10) : sizeof(TTCluster4x16);
+  if (mb_size_ == 0)
+    return;
+
+  cluster_count_ = 0;
+  resize(mb_size_);
+}
+
+std::string
+TranspositionTable::stats(const TTStats &counts) const
+{
+  // 全部を見ると大きな表では時間がかかるので、等間隔に最大4096クラスタを見る
+  const size_t sample = std::min<size_t>(cluster_count_, 4096);
+  const size_t step   = cluster_count_ / sample;
+  uint64_t used = 0;
+  uint64_t age[4] = {};
+  uint64_t bound[4] = {};
+  census(sample, step, &used, age, bound);
+
+  const double entries = static_cast<double>(sample * cluster_size());
+  auto per_mille = [&](uint64_t n) { return static_cast<int>(n * 1000 / (sample * cluster_size())); };
+  auto percent   = [](uint64_t n, uint64_t d) { return d ? 100.0 * n / d : 0.0; };
+
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(1)
+     << "tt size " << cluster_count_ * cluster_bytes_ / (1024 * 1024) << " MB, "
+     << cluster_count_ << " clusters x " << cluster_size() << " entries (" << geometry_name(geometry_)
+     << "), generation " << (generation_ >> 2) << "\n"
+     << "tt memory " << allocation() << "\n"
+     << "tt occupancy " << per_mille(used) << " permill (sampled " << sample << " clusters), by age"
+     << " current " << per_mille(age[0])
+     << " 1 " << per_mille(age[1])
+     << " 2 " << per_mille(age[2])
+     << " 3+ " << per_mille(age[3]) << "\n"
+     << "tt bound none " << percent(bound[kBoundNone], used) << "%"
+     << " upper " << percent(bound[kBoundUpper], used) << "%"
+     << " lower " << percent(bound[kBoundLower], used) << "%"
+     << " exact " << percent(bound[kBoundExact], used) << "%\n"
+     << "tt probes " << counts.probes
+     << " hits " << counts.hits << " (" << percent(counts.hits, counts.probes) << "%)\n"
+     << "tt slots given for store: same key " << counts.hits
+     << " empty " << counts.empty
+     << " depth-age " << counts.replaced << "\n"
+     << "tt hand superiority " << (hand_superiority_ ? "on" : "off")
+     << ", hits from other hands " << counts.hand_hits << "\n"
+     << "qsearch cache probes " << counts.qs_probes
+     << " hits " << counts.qs_hits << " (" << percent(counts.qs_hits, counts.qs_probes) << "%)\n"
+     // 比べるkeyはクラスタの形で16/32/64bit、持ち駒の優越を使うときは盤面の37bitなので、
+     // 別の局面と一致するのはprobeごとに(使用中のエントリ数/2^bit数)程度
+     << std::scientific << std::setprecision(2)
+     << "tt estimated key collisions "
+     << static_cast<double>(counts.probes) * cluster_size() * (used / entries)
+        * std::ldexp(1.0, hand_superiority_ ? kHandBits - 64 : -key_bits());
+  return ss.str();
+}
@@ -24,18 +24,28 @@
 #ifndef _TRANSPOSITION_TABLE_H_
 #define _TRANSPOSITION_TABLE_H_
 
+#include <cstring>
+#include <string>
+#include <vector>
+
 #include "misc.h"
 #include "types.h"
 #include "move.h"
 #include "position.h"
 
-// key        32 bit Stockfishは16bitだが、衝突が多いので32bitにする
-// move       16 bit
-// value      16 bit
-// eval value 16 bit
-// generation  6 bit
-// bound type  2 bit
-// depth       8 bit
+// data_ 64 bit
+//   move        16 bit
+//   value       16 bit
+//   eval value  16 bit
+//   generation   6 bit
+//   bound type   2 bit
+//   depth        8 bit
+// key_  64 bit  局面のkeyとdata_のXOR
+//
+// 複数のスレッドが同期なしに読み書きするので、フィールドごとに書くと
+// 別の局面の指し手と評価値が混ざったエントリを読むことがある
+// data_とkey_をそれぞれ1回で読み書きし、keyが合わなければ壊れたエントリとして捨てる
+// (Stockfishの32bit keyより衝突も少ない)
 class TTEntry 
 {
 public:
@@ -48,127 +58,480 @@ public:
   Value 
   value() const
   {
-    return static_cast<Value>(value16_); 
+    return static_cast<Value>(static_cast<int16_t>(data_ >> 16)); 
   }
 
   Value 
   eval_value() const
   { 
-    return static_cast<Value>(eval_value16_); 
+    return static_cast<Value>(static_cast<int16_t>(data_ >> 32)); 
   }
 
   Depth 
   depth() const 
   { 
-    return static_cast<Depth>(depth8_); 
+    return static_cast<Depth>(static_cast<int8_t>(data_ >> 56)); 
   }
 
   Bound 
   bound() const      
   { 
-    return static_cast<Bound>(generation_and_bound8_ & 0x3); 
+    return static_cast<Bound>(generation_and_bound8() & 0x3); 
   }
 
   void 
   save(Key k, Value v, Bound b, Depth d, Move m, Value ev, uint8_t g) 
   {
-    if (m || (k >> 32) != key32_)
-      move16_ = to_uint16(m);
+    const uint64_t old = data_;
+    store(k, merge((key_ ^ old) == k, old, v, b, d, m, ev, g));
+  }
+
+private:
+  friend class TranspositionTable;
+  friend class QsearchCache;
+  template <typename KeyType> friend class PackedTTEntry;
+
+  // 以下はクラスタの形によらずTranspositionTableから使う
+  // 空いていればtrue
+  bool
+  is_empty() const
+  {
+    return (key_ ^ data_) == 0;
+  }
+
+  // 保存されている局面がkeyなら中身をdata_の形で*dataに入れてtrue
+  bool
+  read(Key key, uint64_t *data) const
+  {
+    *data = data_;
+    return (key_ ^ *data) == key;
+  }
+
+  void
+  store(Key key, uint64_t data)
+  {
+    data_ = data;
+    key_  = key ^ data;
+  }
+
+  // 保存する内容を決める
+  // 同じ局面で深さが足りなければ、指し手だけを書き換えて残りは前の内容にする
+  static uint64_t
+  merge(bool same, uint64_t old, Value v, Bound b, Depth d, Move m, Value ev, uint8_t g)
+  {
+    const uint16_t move16 =
+      (m || !same)
+      ?
+      to_uint16(m)
+      :
+      static_cast<uint16_t>(old);
 
     if
     (
-      (k >> 32) != key32_
+      !same
       ||
-      d > depth8_ - 2
+      d > static_cast<int8_t>(old >> 56) - 2
       ||
       b == kBoundExact
     )
-    {
-      key32_                 = (uint32_t)(k >> 32);
-      value16_               = (int16_t)v;
-      eval_value16_          = (int16_t)ev;
-      generation_and_bound8_ = (uint8_t)(g | b);
-      depth8_                = (int8_t)d;
-    }
+      return pack(move16, v, ev, static_cast<uint8_t>(g | b), d);
+    else
+      return (old & ~0xffffULL) | move16;
   }
 
-private:
-  friend class TranspositionTable;
+  static uint64_t
+  pack(uint16_t move16, Value v, Value ev, uint8_t generation_and_bound8, Depth d)
+  {
+    return
+      static_cast<uint64_t>(move16)
+      |
+      static_cast<uint64_t>(static_cast<uint16_t>(v))  << 16
+      |
+      static_cast<uint64_t>(static_cast<uint16_t>(ev)) << 32
+      |
+      static_cast<uint64_t>(generation_and_bound8)     << 48
+      |
+      static_cast<uint64_t>(static_cast<uint8_t>(d))   << 56;
+  }
 
   Move
   uint16_to_move(const Position &pos) const
   {
-    const Square from =  static_cast<Square>((move16_ >> 7) & 0x007fU);
+    const uint16_t move16 = static_cast<uint16_t>(data_);
+    // 0は指し手を持たないエントリ(移動元と移動先が同じ升の手はない)
+    if (move16 == 0)
+      return kMoveNone;
+
+    const Square from =  static_cast<Square>((move16 >> 7) & 0x007fU);
     if (from >= kBoardSquare)
     {
-      return static_cast<Move>(move16_);
+      return static_cast<Move>(move16);
     }
 
-    const Square to = static_cast<Square>((move16_ >> 0) & 0x007fU);
+    const Square to = static_cast<Square>((move16 >> 0) & 0x007fU);
     const PieceType piece = type_of(pos.square(from));
     const PieceType capture = type_of(pos.square(to));
-    return Move(static_cast<uint32_t>(move16_) | static_cast<uint32_t>(piece << 15) | static_cast<uint32_t>(capture << 19));
+    return Move(static_cast<uint32_t>(move16) | static_cast<uint32_t>(piece << 15) | static_cast<uint32_t>(capture << 19));
   }
 
-  uint16_t
+  static uint16_t
   to_uint16(Move m)
   {
     return static_cast<uint16_t>(m & 0x7fffU);
   }
 
+  uint8_t
+  generation_and_bound8() const
+  {
+    return static_cast<uint8_t>(data_ >> 48);
+  }
+
   uint8_t
   generation() const
   {
-    return generation_and_bound8_ & 0xFC;
+    return generation_and_bound8() & 0xFC;
+  }
+
+  uint64_t data_;
+  uint64_t key_;
+};
+
+// keyの下位だけ(KeyType)を持つ小さいエントリ
+//   key         16 or 32 bit
+//   move        16 bit
+//   value       16 bit
+//   eval value  16 bit
+//   generation   6 bit
+//   bound type   2 bit
+//   depth        8 bit
+// TTEntryと違って1回では読み書きできないので、他のスレッドと同時に書くと
+// 別の局面の内容が混ざることがある(Stockfishと同じく、指し手は探索側で確かめる)
+// クラスタはkeyの上位で選ぶので、下位のbitは同じクラスタの局面を見分けるのに使える
+template <typename KeyType>
+class PackedTTEntry
+{
+public:
+  void 
+  save(Key k, Value v, Bound b, Depth d, Move m, Value ev, uint8_t g) 
+  {
+    uint64_t old = 0;
+    const bool same = read(k, &old);
+    store(k, TTEntry::merge(same, old, v, b, d, m, ev, g));
   }
 
-  uint32_t key32_;
+  Depth 
+  depth() const 
+  { 
+    return static_cast<Depth>(depth8_); 
+  }
+
+  uint8_t
+  generation_and_bound8() const
+  {
+    return generation_and_bound8_;
+  }
+
+  // keyの下位が0の局面は空きと区別できないので、見つからないことにする
+  bool
+  is_empty() const
+  {
+    return key_ == 0;
+  }
+
+  bool
+  read(Key key, uint64_t *data) const
+  {
+    if (key_ != static_cast<KeyType>(key))
+      return false;
+
+    *data = TTEntry::pack(move16_, static_cast<Value>(value16_), static_cast<Value>(eval16_), generation_and_bound8_, static_cast<Depth>(depth8_));
+    return true;
+  }
+
+  void
+  store(Key key, uint64_t data)
+  {
+    key_                   = static_cast<KeyType>(key);
+    move16_                = static_cast<uint16_t>(data);
+    value16_               = static_cast<int16_t>(data >> 16);
+    eval16_                = static_cast<int16_t>(data >> 32);
+    generation_and_bound8_ = static_cast<uint8_t>(data >> 48);
+    depth8_                = static_cast<int8_t>(data >> 56);
+  }
+
+private:
+  KeyType  key_;
   uint16_t move16_;
   int16_t  value16_;
-  int16_t  eval_value16_;
+  int16_t  eval16_;
   uint8_t  generation_and_bound8_;
   int8_t   depth8_;
 };
 
-class TranspositionTable 
+// 置換表のクラスタの形
+// 長い探索では衝突の少ない形、短い持ち時間ではprobeの速い形がよい
+//   3x10  16bitのkeyの10byteエントリを3つで32byte(半キャッシュライン)
+//   5x12  32bitのkeyの12byteエントリを5つで64byte
+//   4x16  64bitのkeyを全部持つ16byteエントリを4つで64byte
+enum TTGeometry
 {
+  kTTGeometry3x10,
+  kTTGeometry5x12,
+  kTTGeometry4x16,
+  kNumberOfTTGeometry
+};
+
+// 1クラスタ(Bytes)にEntryをSize個詰める
+template <typename Entry, int Size, int Bytes>
+struct alignas(Bytes) TTCluster
+{
+  typedef Entry EntryType;
+
   static const int
-  kCacheLineSize = 64;
-  
-  static const int
-  kClusterSize = 5;
+  kSize = Size;
 
-  struct Cluster 
+  Entry entry[Size];
+};
+
+typedef TTCluster<PackedTTEntry<uint16_t>, 3, 32> TTCluster3x10;
+typedef TTCluster<PackedTTEntry<uint32_t>, 5, 64> TTCluster5x12;
+typedef TTCluster<TTEntry,                 4, 64> TTCluster4x16;
+
+static_assert(sizeof(TTCluster3x10) == 32, "TTCluster3x10 must be 32 bytes");
+static_assert(sizeof(TTCluster5x12) == 64, "TTCluster5x12 must be 64 bytes");
+static_assert(sizeof(TTCluster4x16) == 64, "TTCluster4x16 must be 64 bytes");
+
+// probeが返す書き込み先
+// クラスタの形でエントリの型が違うので、エントリと形を一緒に持つ
+class TTSlot
+{
+public:
+  TTSlot() 
+  : 
+  entry_(nullptr), geometry_(kTTGeometry4x16)
+  {}
+
+  explicit TTSlot(PackedTTEntry<uint16_t> *e) 
+  : 
+  entry_(e), geometry_(kTTGeometry3x10)
+  {}
+
+  explicit TTSlot(PackedTTEntry<uint32_t> *e) 
+  : 
+  entry_(e), geometry_(kTTGeometry5x12)
+  {}
+
+  explicit TTSlot(TTEntry *e) 
+  : 
+  entry_(e), geometry_(kTTGeometry4x16)
+  {}
+
+  explicit operator bool() const
   {
-    TTEntry entry[kClusterSize];
-  };
+    return entry_ != nullptr;
+  }
+
+  void 
+  save(Key k, Value v, Bound b, Depth d, Move m, Value ev, uint8_t g) const
+  {
+    switch (geometry_)
+    {
+    case kTTGeometry3x10:
+      static_cast<PackedTTEntry<uint16_t> *>(entry_)->save(k, v, b, d, m, ev, g);
+      break;
+
+    case kTTGeometry5x12:
+      static_cast<PackedTTEntry<uint32_t> *>(entry_)->save(k, v, b, d, m, ev, g);
+      break;
+
+    default:
+      static_cast<TTEntry *>(entry_)->save(k, v, b, d, m, ev, g);
+      break;
+    }
+  }
+
+private:
+  void       *entry_;
+  TTGeometry  geometry_;
+};
+
+// 探索中に数える置換表の統計
+// 共有するとキャッシュラインの取り合いになるので、スレッドごとに数えて後で合計する
+struct TTStats
+{
+  uint64_t probes;
+  uint64_t hits;           // 同じ局面のエントリを渡した
+  uint64_t empty;          // 空きエントリを渡した
+  uint64_t replaced;       // 別の局面のエントリを深さと世代で選んで渡した
+  uint64_t hand_hits;      // 持ち駒の優越で別の局面のエントリを使った
+  uint64_t qs_probes;      // qsearch用の表を引いた
+  uint64_t qs_hits;
+
+  void
+  clear()
+  {
+    std::memset(this, 0, sizeof(*this));
+  }
+
+  TTStats &
+  operator+=(const TTStats &rhs)
+  {
+    probes   += rhs.probes;
+    hits     += rhs.hits;
+    empty    += rhs.empty;
+    replaced += rhs.replaced;
+    hand_hits += rhs.hand_hits;
+    qs_probes += rhs.qs_probes;
+    qs_hits   += rhs.qs_hits;
+    return *this;
+  }
+};
+
+// 共有メモリに置いた置換表の先頭(transposition_table.cpp)
+struct SharedTTHeader;
+
+class TranspositionTable 
+{
+  static const int
+  kCacheLineSize = 64;
 
 public:
+  TranspositionTable()
+  :
+  cluster_count_(0), cluster_bytes_(sizeof(TTCluster4x16)), table_(nullptr), mem_(nullptr), mem_size_(0),
+  page_mode_(""), hand_superiority_(false), generation_(0), mb_size_(0),
+  geometry_(kTTGeometry4x16), requested_geometry_(kTTGeometry4x16), shared_(nullptr), shared_slot_(-1),
+  verbose_(false)
+  {}
+
   ~TranspositionTable() 
   { 
-    free(mem_); 
+    release(); 
   }
 
+  // 共有メモリの表では、どのプロセスが探索を始めても全員の世代が進む
   void 
   new_search() 
   { 
-    generation_ += 4; 
+    if (shared_)
+      generation_ = shared_new_search();
+    else
+      generation_ += 4; 
   }
 
-  TTEntry * 
-  probe(const Key key, bool *found) const;
+  // 書き込み先のエントリを返す
+  // 見つかったときは読んだ時点の内容を*dataにコピーする(見つからなければ空のエントリ)
+  // 他のスレッドが書き換えることがあるので、読むときは返り値ではなく*dataを使う
+  // statsを渡すとprobeの結果を数える
+  // keyはkey(pos, ...)で作ったもの
+  // 書き込み先の形はクラスタの形による
+  TTSlot 
+  probe(const Position &pos, const Key key, bool *found, TTEntry *data, TTStats *stats = nullptr) const
+  {
+    switch (geometry_)
+    {
+    case kTTGeometry3x10:
+      return probe<TTCluster3x10>(key, found, data, stats);
+
+    case kTTGeometry5x12:
+      return probe<TTCluster5x12>(key, found, data, stats);
+
+    default:
+      return
+        hand_superiority_
+        ?
+        probe_hand(pos.board_key(), key, found, data, stats)
+        :
+        probe<TTCluster4x16>(key, found, data, stats);
+    }
+  }
 
-  TTEntry * 
+  // posを置換表で引くときのkey
+  // 通常は局面のkeyで、クラスタもこれで選ぶ
+  // 持ち駒の優越を使うときは、盤面のkeyの下位37bitの後ろに手番側の持ち駒(27bit)を付ける
+  // クラスタは盤面のkeyで選ぶので、盤面が同じで持ち駒だけが違う局面は同じクラスタに入る
+  Key
+  key(const Position &pos, bool excluded) const
+  {
+    if (!hand_superiority_)
+      return excluded ? pos.exclusion_key() : pos.key();
+
+    const Key board_key = excluded ? pos.board_key() ^ kExclusionBoardKey : pos.board_key();
+    return (board_key << kHandBits) | pos.hand(pos.side_to_move());
+  }
+
+  // keyを[0, cluster_count_)に写す
+  // 掛け算の上位を取るので、クラスタ数が2のべき乗でなくても分岐なしで引ける
+  void * 
   first_entry(const Key key) const
   {
-    return &table_[(size_t)key & (cluster_count_ - 1)].entry[0];
+    return table_ + mul_hi64(key, cluster_count_) * cluster_bytes_;
+  }
+
+  // 局面のboard_keyとhand_keyからクラスタを選ぶ(先読み用)
+  void * 
+  first_entry(const Key board_key, const Key hand_key) const
+  {
+    return first_entry(hand_superiority_ ? board_key : board_key + hand_key);
+  }
+
+  // 持ち駒の優越を使うかどうか
+  // keyの作り方が変わるので表は空にする
+  // keyの下位は持ち駒なので、使うときはクラスタの形に関係なく4x16にする
+  void
+  set_hand_superiority(bool enable)
+  {
+    if (hand_superiority_ != enable)
+      set_layout(requested_geometry_, enable);
+  }
+
+  // クラスタの形を変える(表は作り直して空にする)
+  void
+  set_geometry(TTGeometry geometry)
+  {
+    if (requested_geometry_ != geometry)
+      set_layout(geometry, hand_superiority_);
+  }
+
+  // "3x10"などの名前
+  static const char *
+  geometry_name(TTGeometry geometry);
+
+  // 実際に使っているクラスタの形
+  TTGeometry
+  geometry() const
+  {
+    return geometry_;
   }
 
   void 
   resize(uint64_t mb_size);
 
+  // 共有メモリの表を他のプロセスも使っているときは、forceでなければ空にしない
   void 
-  clear();
+  clear(bool force = false);
+
+  // trueなら空にするのにかかった時間を表示する(benchのttstatsで使う)
+  // usinewgameやusiの前にGUIの知らない出力をしないよう、普段は表示しない
+  void
+  set_verbose(bool verbose)
+  {
+    verbose_ = verbose;
+  }
+
+  // 表をnameという名前のPOSIX共有メモリに置き、同じ名前を指定した他のプロセスと共有する
+  // "<empty>"なら自分だけの表に戻す
+  // 先に作ったプロセスの大きさとクラスタの形を使い、形が違えば自分だけの表にする
+  void
+  set_shared(const std::string &name);
+
+  // 現在の世代のエントリの割合(千分率)を先頭の1000エントリから見積もる
+  int
+  hashfull() const;
+
+  // 表を間引いて調べた使用状況とcountsをまとめて、1行ずつの文字列にする
+  std::string
+  stats(const TTStats &counts) const;
 
   uint8_t
   generation() const
@@ -176,13 +539,145 @@ public:
     return generation_;
   }
 
+  // 表をファイルに書き出す
+  bool
+  save(const std::string &path) const;
+
+  // save()で書き出した表を読み込む
+  // 大きさと世代もファイルのものになる(USI_Hashの値は使わない)
+  // mapがtrueならファイルをコピーオンライトでmmapし、探索で書き換えてもファイルは変わらない
+  bool
+  load(const std::string &path, bool map);
+
+  // 実際に使われたページとNUMAの割り当て方
+  std::string
+  allocation() const
+  {
+    return std::string(page_mode_) + ", numa " + numa_mode_;
+  }
+
+  // 大きさ、クラスタの形、割り当て方(と共有しているプロセスの数)
+  // USIのsetoptionで表を作り直したときに表示する
+  std::string
+  description() const;
+
 private:
-  size_t     cluster_count_;
-  Cluster   *table_;
-  void      *mem_;
-  uint8_t    generation_;
+  static const int
+  kHandBits = 27;
+
+  static const Key
+  kExclusionBoardKey = 0x6a09e667f3bcc908ULL;
+
+  template <typename Cluster>
+  TTSlot 
+  probe(const Key key, bool *found, TTEntry *data, TTStats *stats) const;
+
+  TTSlot 
+  probe_hand(const Key board_key, const Key key, bool *found, TTEntry *data, TTStats *stats) const;
+
+  // 深さと世代から置き換えるエントリを選ぶ
+  template <typename Cluster>
+  typename Cluster::EntryType *
+  replace_entry(Cluster *cluster) const;
+
+  // stepごとにsample個のクラスタを見て、使用中のエントリを世代と境界の種類ごとに数える
+  template <typename Cluster>
+  void
+  census(size_t sample, size_t step, uint64_t *used, uint64_t age[4], uint64_t bound[4]) const;
+
+  void
+  census(size_t sample, size_t step, uint64_t *used, uint64_t age[4], uint64_t bound[4]) const;
+
+  // 1クラスタのエントリ数と比べるkeyのbit数
+  int
+  cluster_size() const;
+
+  int
+  key_bits() const;
+
+  // エントリの大きさ(keyと64bitの中身)
+  int
+  entry_bytes() const
+  {
+    return key_bits() / 8 + 8;
+  }
+
+  void
+  set_layout(TTGeometry geometry, bool hand_superiority);
+
+  void
+  allocate(size_t size);
+
+  // shared_name_の共有メモリを作るか、すでにあればつなぐ
+  bool
+  attach_shared(size_t size);
+
+  // 表を使っている(生きている)プロセスの数
+  int
+  shared_users() const;
+
+  uint8_t
+  shared_new_search();
+
+  void
+  release();
+
+  size_t      cluster_count_;
+  size_t      cluster_bytes_;
+  char       *table_;
+  void       *mem_;
+  size_t      mem_size_;
+  const char *page_mode_;
+  std::string numa_mode_;
+  bool        hand_superiority_;
+  uint8_t     generation_;
+  uint64_t    mb_size_;
+  TTGeometry  geometry_;
+  TTGeometry  requested_geometry_;
+  std::string     shared_name_;
+  SharedTTHeader *shared_;
+  int             shared_slot_;
+  bool            verbose_;
 };
 
 extern TranspositionTable TT;
 
+// qsearch用のスレッドごとの小さな置換表(L2に乗る程度の大きさ)
+// 浅いqsearchの結果で共有の置換表のクラスタを書き換えると、
+// 他のコアとのキャッシュラインのやり取りが増え、深い探索のエントリも追い出されるので、
+// qsearchはまずこちらを引き、共有の置換表にはカットか確定値だけを入れる
+// 他のスレッドからは触らないので、1エントリ1局面の直接マップで上書きする
+class QsearchCache
+{
+public:
+  // 0なら使わない
+  void
+  resize(size_t kb_size);
+
+  void
+  clear();
+
+  // 使わないときはnullptrを返す
+  TTEntry *
+  probe(const Key key, bool *found, TTEntry *data, TTStats *stats)
+  {
+    *found = false;
+    if (entries_.empty())
+      return nullptr;
+
+    TTEntry *e = &entries_[mul_hi64(key, entries_.size())];
+    ++stats->qs_probes;
+    if ((e->key_ ^ e->data_) == key)
+    {
+      ++stats->qs_hits;
+      *data  = *e;
+      *found = true;
+    }
+    return e;
+  }
+
+private:
+  std::vector<TTEntry> entries_;
+};
+
 #endif
@@ -21,12 +21,17 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "evaluate.h"
+#include "misc.h"
 #include "position.h"
 #include "search.h"
 #include "thread.h"
@@ -92,6 +97,51 @@ position(Position& pos, istringstream& is)
   }
 }
 
+// ファイルの局面(1行に1局面のsfen)をまとめて評価し、手番側から見た評価値を1行ずつ出力する
+// eval_batch <path>
+void
+eval_batch(istringstream& is)
+{
+  string path;
+  if (!(is >> path))
+  {
+    sync_cout << "info string usage: eval_batch <path>" << sync_endl;
+    return;
+  }
+
+  ifstream ifs(path);
+  if (!ifs)
+  {
+    sync_cout << "info string eval_batch open failed: " << path << sync_endl;
+    return;
+  }
+
+  // Positionは自分のStateInfoを指しているので、要素が動かないdequeに置く
+  deque<Position> positions;
+  string line;
+  while (getline(ifs, line))
+  {
+    if (line.compare(0, 5, "sfen ") == 0)
+      line.erase(0, 5);
+    if (!line.empty())
+      positions.emplace_back(line, Threads.main());
+  }
+
+  vector<const Position *> pointers;
+  for (const Position &pos : positions)
+    pointers.push_back(&pos);
+  vector<Value> values(positions.size());
+
+  TimePoint elapsed = now();
+  Eval::evaluate_batch(pointers.data(), pointers.size(), values.data());
+  elapsed = now() - elapsed;
+
+  for (Value v : values)
+    sync_cout << v << sync_endl;
+  sync_cout << "info string eval_batch " << values.size() << " positions "
+            << elapsed << " ms" << sync_endl;
+}
+
 void 
 setoption(istringstream& is) 
 {
@@ -164,7 +214,13 @@ go(const Position &pos, istringstream &is)
     }
     else if (token == "mate")
     {
-      is >> limits.mate;
+      // go mate <ミリ秒|infinite>は詰みだけを調べる
+      is >> token;
+      limits.solve_mate = true;
+      if (token == "infinite")
+        limits.infinite = true;
+      else
+        limits.movetime = std::atoi(token.c_str());
     }
     else if (token == "infinite")
     {
@@ -232,7 +288,10 @@ USI::loop(int argc, char* argv[])
     }
     else if (token == "usinewgame")
     {
-      TT.clear();
+      // HashFileを指定していれば、空の表ではなくその表から始める
+      const string hash_file = Options["HashFile"];
+      if (hash_file == "<empty>" || !TT.load(hash_file, true))
+        TT.clear();
     }
     else if (token == "go")
     {
@@ -254,6 +313,61 @@ USI::loop(int argc, char* argv[])
     {
       sync_cout << "readyok" << sync_endl;
     }
+    else if (token == "eval_batch")
+    {
+      eval_batch(is);
+    }
+    else if (token == "tt")
+    {
+      // tt stats       : 置換表の使用状況と直前の探索での統計を表示する
+      // tt save <path> : 置換表を書き出す
+      // tt load <path> : 書き出した置換表を読み込む
+      string path;
+      is >> token;
+      if (token == "stats")
+      {
+        istringstream lines(TT.stats(Threads.tt_stats()));
+        string line;
+        while (getline(lines, line))
+          sync_cout << "info string " << line << sync_endl;
+      }
+      else if (token == "save" && is >> path)
+      {
+        Threads.main()->wait_for_search_finished();
+        sync_cout << "info string tt save " << path
+                  << (TT.save(path) ? " done" : " failed") << sync_endl;
+      }
+      else if (token == "load" && is >> path)
+      {
+        Threads.main()->wait_for_search_finished();
+        TT.load(path, false);
+      }
+      else
+      {
+        sync_cout << "info string usage: tt stats | tt save <path> | tt load <path>" << sync_endl;
+      }
+    }
+    else if (token == "convert_eval")
+    {
+      // 読み込んでいる重みを指定した形式で書き出す
+      // convert_eval <path> [container|packed|full]
+      string path;
+      string format = "container";
+      if (is >> path)
+      {
+        is >> format;
+        const bool result =
+          format == "packed" ? Eval::save(path, Eval::kEvalFileRawPacked)
+          : format == "full" ? Eval::save(path, Eval::kEvalFileRawFull)
+          : Eval::save(path, Eval::kEvalFileContainer);
+        sync_cout << "info string convert_eval " << path << " " << format
+                  << (result ? " done" : " failed") << sync_endl;
+      }
+      else
+      {
+        sync_cout << "info string usage: convert_eval <path> [container|packed|full]" << sync_endl;
+      }
+    }
     else
     {
       sync_cout << "Unknown command: " << cmd << sync_endl;
@@ -26,6 +26,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include "types.h"
 
@@ -52,6 +53,8 @@ public:
   Option(bool v, OnChange = nullptr);
   Option(const char *v, OnChange = nullptr);
   Option(int v, int min, int max, OnChange = nullptr);
+  // varsのどれかを選ぶ(USIのcombo)
+  Option(const char *v, const std::vector<std::string> &vars, OnChange = nullptr);
 
   Option &
   operator=(const std::string &v);
@@ -66,6 +69,7 @@ private:
   std::string default_value_;
   std::string current_value_;
   std::string type_;
+  std::vector<std::string> vars_;
   int min_;
   int max_;
   size_t index_;
@@ -27,6 +27,7 @@
 #include <sstream>
 
 #include "evaluate.h"
+#include "mate_solver.h"
 #include "misc.h"
 #include "thread.h"
 #include "transposition_table.h"
@@ -50,16 +51,79 @@ on_threads(const Option &)
   Threads.read_usi_options(); 
 }
 
+// 表を作り直すoptionのときは、確保した表を表示する
+// 起動時(usiの前)のresizeでは表示しない
+void
+report_hash()
+{
+  sync_cout << "info string hash " << TT.description() << sync_endl;
+}
+
 void 
 on_hash_size(const Option &o) 
 { 
   TT.resize(o); 
+  report_hash();
 }
 
 void 
 on_clear_hash(const Option &) 
 { 
-  TT.clear(); 
+  // 共有メモリの表でも消す
+  TT.clear(true); 
+}
+
+void 
+on_hash_file(const Option &o) 
+{ 
+  const std::string path = o;
+  if (path != "<empty>")
+    TT.load(path, true);
+}
+
+void 
+on_hash_shared(const Option &o) 
+{ 
+  TT.set_shared(o);
+  report_hash();
+}
+
+void 
+on_tt_hand_superiority(const Option &o) 
+{ 
+  TT.set_hand_superiority(o); 
+  report_hash();
+}
+
+void 
+on_tt_geometry(const Option &o) 
+{ 
+  const std::string name = o;
+  for (int g = 0; g < kNumberOfTTGeometry; ++g)
+  {
+    if (name == TranspositionTable::geometry_name(static_cast<TTGeometry>(g)))
+      TT.set_geometry(static_cast<TTGeometry>(g));
+  }
+  report_hash();
+}
+
+void 
+on_qsearch_hash_size(const Option &o) 
+{ 
+  for (Thread *th : Threads)
+    th->qsearch_cache_.resize(static_cast<int>(o));
+}
+
+void 
+on_eval_hash_size(const Option &o) 
+{ 
+  Eval::EH.resize(o); 
+}
+
+void 
+on_mate_hash_size(const Option &o) 
+{ 
+  Mate.resize(o); 
 }
 
 bool 
@@ -78,13 +142,30 @@ void
 init(OptionsMap& o) 
 {
   o["BookFile"]                    = Option("book.bin");
+#ifdef Apery
+  o["EvalFile"]                    = Option("eval_apery.bin", on_eval);
+  o["EvalDir"]                     = Option(".", on_eval);
+#else
+  o["EvalFile"]                    = Option("new_fv.bin", on_eval);
+#endif
   o["Contempt"]                    = Option(0, -50,  50);
   o["Threads"]                     = Option(1, 1, 128, on_threads);
   o["USI_Hash"]                    = Option(32, 1, 16384, on_hash_size);
   o["Clear_Hash"]                  = Option(on_clear_hash);
+  o["HashFile"]                    = Option("<empty>", on_hash_file);
+  o["HashShared"]                  = Option("<empty>", on_hash_shared);
+  o["TTHandSuperiority"]           = Option(false, on_tt_hand_superiority);
+  o["TTGeometry"]                  = Option("4x16", { "3x10", "5x12", "4x16" }, on_tt_geometry);
+  o["QsearchHash"]                 = Option(0, 0, 65536, on_qsearch_hash_size);
+  o["EvalHash"]                    = Option(16, 0, 1024, on_eval_hash_size);
+  o["MateHash"]                    = Option(64, 1, 4096, on_mate_hash_size);
+  o["MateThread"]                  = Option(false);
+  o["MatePly"]                     = Option("1", { "1", "3", "5", "7" });
   o["USI_Ponder"]                  = Option(true);
   o["OwnBook"]                     = Option(true);
   o["MultiPV"]                     = Option(1, 1, 500);
+  o["MultiPVSplit"]                = Option(false);
+  o["SmpHelper"]                   = Option("HalfDensity", { "HalfDensity", "DepthOffset", "ABDADA" });
   o["ByoyomiMargin"]               = Option(0, 0, 5000);
 }
 
@@ -106,6 +187,9 @@ operator<<(std::ostream &os, const OptionsMap &om)
         if (o.type_ == "spin")
           os << " min " << o.min_ << " max " << o.max_;
 
+        for (const string &var : o.vars_)
+          os << " var " << var;
+
         break;
       }
     }
@@ -140,6 +224,13 @@ type_("spin"), min_(minv), max_(maxv), index_(Options.size()), on_change_(f)
   default_value_ = current_value_ = ss.str(); 
 }
 
+Option::Option(const char *v, const std::vector<string> &vars, OnChange f) 
+: 
+type_("combo"), vars_(vars), min_(0), max_(0), index_(Options.size()), on_change_(f)
+{ 
+  default_value_ = current_value_ = v; 
+}
+
 Option::operator int() const 
 {
   assert(type_ == "check" || type_ == "spin");
@@ -148,7 +239,7 @@ Option::operator int() const
 
 Option::operator std::string() const 
 {
-  assert(type_ == "string");
+  assert(type_ == "string" || type_ == "combo");
   return current_value_;
 }
 
@@ -164,6 +255,8 @@ Option::operator=(const string &v)
     (type_ == "check" && v != "true" && v != "false")
     || 
     (type_ == "spin" && (atoi(v.c_str()) < min_ || atoi(v.c_str()) > max_))
+    ||
+    (type_ == "combo" && std::find(vars_.begin(), vars_.end(), v) == vars_.end())
   )
     return *this;
 